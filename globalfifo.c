@@ -1,86 +1,1259 @@
 #include "globalfifo.h"
 
+#define CREATE_TRACE_POINTS
+#include "globalfifo_trace.h"
+
+static struct globalfifo_dev *globalfifo_filp_dev(struct file *filp) {
+    return ((struct globalfifo_file *)filp->private_data)->dev;
+}
+
+// BROADCAST mode: the slowest reader's cursor, everything before it has
+// been seen by all. with nobody left to read, nothing needs keeping.
+// called with dev->mutex and dev->ow_lock held
+static unsigned int globalfifo_bcast_tail(struct globalfifo_dev *dev) {
+    unsigned int head = dev->ring->head, lag = 0;
+    struct globalfifo_file *gf;
+
+    list_for_each_entry(gf, &dev->readers, reader)
+        lag = max(lag, head - gf->cursor);
+    return head - lag;
+}
+
+// BROADCAST mode writer, with dev->mutex held (dev->ow_lock in overwrite
+// mode): make tail follow the readers before looking for room, cutting off
+// the ones an overwrite left behind
+static void globalfifo_bcast_cut(struct globalfifo_dev *dev) {
+    unsigned int tail = dev->ring->tail;
+    struct globalfifo_file *gf;
+    bool cut = false;
+
+    if (list_empty(&dev->readers)) {
+        smp_store_release(&dev->ring->tail, dev->ring->head);
+        return;
+    }
+    // without overwrite tail never passes a cursor
+    if (!(dev->flags & GLOBALFIFO_F_OVERWRITE))
+        return;
+    list_for_each_entry(gf, &dev->readers, reader) {
+        if ((int)(tail - gf->cursor) > 0) {
+            gf->cursor = tail;
+            WRITE_ONCE(gf->lagged, true);
+            cut = true;
+        }
+    }
+    if (cut)
+        wake_up_interruptible_all(&dev->r_wait);
+}
+
+// SIGIO to the fasync owners and a count on the attached eventfd, for the
+// same changes in readiness that wake r_wait (POLL_IN) or w_wait (POLL_OUT)
+static void globalfifo_notify(struct globalfifo_dev *dev, int band) {
+    struct eventfd_ctx *ctx;
+
+    kill_fasync(&dev->async_queue, SIGIO, band);
+    rcu_read_lock();
+    ctx = rcu_dereference(dev->eventfd);
+    if (ctx)
+        eventfd_signal(ctx, 1);
+    rcu_read_unlock();
+}
+
+static int globalfifo_fasync(int fd, struct file *filp, int mode) {
+    return fasync_helper(fd, filp, mode, &globalfifo_filp_dev(filp)->async_queue);
+}
+
+static struct globalfifo_dev *globalfifo_get_dev(unsigned int minor);
+
 static int globalfifo_open(struct inode *inode, struct file *filp) {
-    struct globalfifo_dev* dev = container_of(inode->i_cdev, struct globalfifo_dev, cdev);
-    filp->private_data = dev;
+    struct globalfifo_dev *dev = globalfifo_get_dev(iminor(inode));
+    struct globalfifo_file *gf;
+
+    if (IS_ERR(dev))
+        return PTR_ERR(dev);
+    gf = kmalloc(sizeof(*gf), GFP_KERNEL);
+    if (!gf)
+        return -ENOMEM;
+    gf->dev = dev;
+    gf->shard = -1;
+    gf->lagged = false;
+    INIT_LIST_HEAD(&gf->reader);
+    filp->private_data = gf;
+    // IOCB_NOWAIT is honoured instead of sleeping on r_wait/w_wait
+    filp->f_mode |= FMODE_NOWAIT;
+
+    mutex_lock(&dev->mutex);
+    dev->nr_open++;
+    // a broadcast reader joins at the end, it only sees what comes next
+    spin_lock(&dev->ow_lock);
+    gf->cursor = dev->ring->head;
+    if (filp->f_mode & FMODE_READ)
+        list_add_tail(&gf->reader, &dev->readers);
+    spin_unlock(&dev->ow_lock);
+    mutex_unlock(&dev->mutex);
+    return 0;
+}
+
+static int globalfifo_release(struct inode *inode, struct file *filp) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(filp);
+    struct globalfifo_file *gf = filp->private_data;
+
+    mutex_lock(&dev->mutex);
+    dev->nr_open--;
+    spin_lock(&dev->ow_lock);
+    list_del(&gf->reader);
+    // the slowest reader going away frees its backlog
+    if (dev->mode == GLOBALFIFO_MODE_BROADCAST && gf->cursor == dev->ring->tail) {
+        smp_store_release(&dev->ring->tail, globalfifo_bcast_tail(dev));
+        wake_up_interruptible(&dev->w_wait);
+        globalfifo_notify(dev, POLL_OUT);
+    }
+    spin_unlock(&dev->ow_lock);
+    mutex_unlock(&dev->mutex);
+    globalfifo_fasync(-1, filp, 0);
+    kfree(gf);
+    return 0;
+}
+
+// bytes in the FIFO without any lock. tail is read first and head only
+// grows, so the difference can't go negative, only be slightly stale
+static unsigned int globalfifo_len(struct globalfifo_dev *dev) {
+    unsigned int tail = READ_ONCE(dev->ring->tail);
+
+    smp_rmb();
+    return min_t(unsigned int, READ_ONCE(dev->ring->head) - tail, READ_ONCE(dev->buf.size));
+}
+
+// what a read could take right now, whatever the mode
+static unsigned int globalfifo_queued(struct globalfifo_dev *dev) {
+    if (READ_ONCE(dev->mode) == GLOBALFIFO_MODE_PERCPU)
+        return atomic_read(&dev->pcpu_len);
+    return globalfifo_len(dev);
+}
+
+static void globalfifo_wait_begin(struct globalfifo_dev *dev, bool writer) {
+    this_cpu_inc(dev->stats->waits);
+    trace_globalfifo_sleep(dev->minor, writer);
+}
+
+static void globalfifo_wait_end(struct globalfifo_dev *dev, bool writer) {
+    trace_globalfifo_wakeup(dev->minor, writer);
+}
+
+// wrap one of the wait_event*() macros for the counters and tracepoints
+#define globalfifo_wait(dev, writer, wait) ({     \
+    int __ret;                                    \
+    globalfifo_wait_begin(dev, writer);           \
+    __ret = (wait);                               \
+    globalfifo_wait_end(dev, writer);             \
+    __ret;                                        \
+})
+
+// every read() or write() that got to a mode: count it and trace it
+static void globalfifo_account(struct globalfifo_dev *dev, bool write, ssize_t ret) {
+    if (ret == -EAGAIN)
+        this_cpu_inc(dev->stats->eagain);
+    if (ret > 0) {
+        if (write) {
+            this_cpu_inc(dev->stats->writes);
+            this_cpu_add(dev->stats->write_bytes, ret);
+        } else {
+            this_cpu_inc(dev->stats->reads);
+            this_cpu_add(dev->stats->read_bytes, ret);
+        }
+    }
+    if (write && trace_globalfifo_write_enabled())
+        trace_globalfifo_write(dev->minor, ret, globalfifo_queued(dev));
+    if (!write && trace_globalfifo_read_enabled())
+        trace_globalfifo_read(dev->minor, ret, globalfifo_queued(dev));
+}
+
+// address of byte @pos of @buf, and how many bytes on from it are in the
+// same page
+static void *globalfifo_buf_addr(struct globalfifo_buf *buf, unsigned int pos, size_t *chunk) {
+    unsigned int off = pos & (buf->size - 1);
+
+    *chunk = min_t(size_t, *chunk, PAGE_SIZE - offset_in_page(off));
+    return page_address(buf->pages[off >> PAGE_SHIFT]) + offset_in_page(off);
+}
+
+// copy @count bytes out of @buf from @pos on, a page at a time, wrapping
+// around its end
+static size_t globalfifo_copy_out(struct globalfifo_buf *buf, struct iov_iter *to, unsigned int pos, size_t count) {
+    size_t copied = 0;
+
+    while (copied < count) {
+        size_t chunk = count - copied;
+        void *addr = globalfifo_buf_addr(buf, pos + copied, &chunk);
+        size_t n = copy_to_iter(addr, chunk, to);
+
+        copied += n;
+        if (n != chunk)
+            break;
+    }
+    return copied;
+}
+
+// copy @count bytes into @buf from @pos on, the same way
+static size_t globalfifo_copy_in(struct globalfifo_buf *buf, struct iov_iter *from, unsigned int pos, size_t count) {
+    size_t copied = 0;
+
+    while (copied < count) {
+        size_t chunk = count - copied;
+        void *addr = globalfifo_buf_addr(buf, pos + copied, &chunk);
+        size_t n = copy_from_iter(addr, chunk, from);
+
+        copied += n;
+        if (n != chunk)
+            break;
+    }
+    return copied;
+}
+
+// copy between the ring and kernel memory, used for the record headers
+static void globalfifo_peek(struct globalfifo_buf *buf, unsigned int pos, void *to, size_t len) {
+    while (len) {
+        size_t chunk = len;
+        void *addr = globalfifo_buf_addr(buf, pos, &chunk);
+
+        memcpy(to, addr, chunk);
+        pos += chunk;
+        to += chunk;
+        len -= chunk;
+    }
+}
+
+static void globalfifo_poke(struct globalfifo_buf *buf, unsigned int pos, const void *from, size_t len) {
+    while (len) {
+        size_t chunk = len;
+        void *addr = globalfifo_buf_addr(buf, pos, &chunk);
+
+        memcpy(addr, from, chunk);
+        pos += chunk;
+        from += chunk;
+        len -= chunk;
+    }
+}
+
+static void globalfifo_buf_free(struct globalfifo_buf *buf) {
+    unsigned int i;
+
+    if (!buf->pages)
+        return;
+    // a pipe may still hold some of them
+    for (i = 0; i < buf->size >> PAGE_SHIFT; ++i)
+        if (buf->pages[i])
+            put_page(buf->pages[i]);
+    kvfree(buf->pages);
+    buf->pages = NULL;
+}
+
+// @size bytes in order-0 pages, zeroed as they may end up mapped to user
+// space. only the page pointer array may come from vmalloc
+static int globalfifo_buf_alloc(struct globalfifo_buf *buf, unsigned int size, int node) {
+    unsigned int i;
+
+    buf->size = size;
+    buf->pages = kvcalloc(size >> PAGE_SHIFT, sizeof(*buf->pages), GFP_KERNEL);
+    if (!buf->pages)
+        return -ENOMEM;
+    for (i = 0; i < size >> PAGE_SHIFT; ++i) {
+        buf->pages[i] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+        if (!buf->pages[i]) {
+            globalfifo_buf_free(buf);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// about to write [@pos, @pos + @len) of @buf. a page splice_read lent out
+// may be referenced past the pipe, by a socket still sending it say, so
+// one with users besides the ring is swapped for a copy, not written under
+// them
+static int globalfifo_unshare(struct globalfifo_buf *buf, unsigned int pos, size_t len, int node, gfp_t gfp) {
+    while (len) {
+        unsigned int off = pos & (buf->size - 1);
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(off));
+        struct page **slot = &buf->pages[off >> PAGE_SHIFT];
+        struct page *copy;
+
+        if (page_count(*slot) > 1) {
+            copy = alloc_pages_node(node, gfp, 0);
+            if (!copy)
+                return -ENOMEM;
+            // the rest of the page may still be queued
+            copy_page(page_address(copy), page_address(*slot));
+            put_page(*slot);
+            *slot = copy;
+        } else {
+            // the last user's put_page() comes before our stores
+            smp_acquire__after_ctrl_dep();
+        }
+        pos += chunk;
+        len -= chunk;
+    }
     return 0;
 }
 
-static int globalfifo_release(struct inode *inode, struct file *filp) {
-    return 0;
+// free bytes a write of @count needs before it may go ahead: a byte
+// stream takes what fits, a record goes in whole or not at all
+static unsigned int globalfifo_need(struct globalfifo_dev *dev, size_t count) {
+    if (dev->flags & GLOBALFIFO_F_PACKET)
+        return sizeof(struct globalfifo_pkt_hdr) + count;
+    return 1;
+}
+
+// queued bytes a blocked read waits for. short reads wait for the full
+// mark too, as the writer side only wakes readers once it is reached
+static unsigned int globalfifo_rcv_want(struct globalfifo_dev *dev) {
+    return READ_ONCE(dev->rcvlowat);
+}
+
+// free bytes a blocked write of @count waits for, never less than it needs
+static unsigned int globalfifo_snd_want(struct globalfifo_dev *dev, size_t count) {
+    return max(globalfifo_need(dev, count), READ_ONCE(dev->sndlowat));
+}
+
+// GLOBALFIFO_F_TIMESTAMP: remember when the write ending at @end came in
+static void globalfifo_stamp(struct globalfifo_stamps *st, unsigned int end) {
+    if (st->head - st->tail == GLOBALFIFO_NR_STAMPS) {
+        st->ent[(st->head - 1) % GLOBALFIFO_NR_STAMPS].end = end;
+        return;
+    }
+    st->ent[st->head % GLOBALFIFO_NR_STAMPS].end = end;
+    st->ent[st->head % GLOBALFIFO_NR_STAMPS].ns = ktime_get_ns();
+    st->head++;
+}
+
+// retire the stamps of writes that are gone entirely now that tail is at
+// @tail, into the latency histogram if a reader took them
+static void globalfifo_unstamp(struct globalfifo_dev *dev, struct globalfifo_stamps *st,
+                               unsigned int tail, bool consumed) {
+    u64 now;
+
+    if (st->head == st->tail)
+        return;
+    now = ktime_get_ns();
+    while (st->tail != st->head && (int)(tail - st->ent[st->tail % GLOBALFIFO_NR_STAMPS].end) >= 0) {
+        if (consumed)
+            atomic64_inc(&dev->lat_hist[ilog2(max_t(u64, now - st->ent[st->tail % GLOBALFIFO_NR_STAMPS].ns, 1))]);
+        st->tail++;
+    }
+}
+
+// overwrite mode: move @tail on until @room bytes are free before @head,
+// dropping whole records in packet mode. returns the new tail
+static unsigned int globalfifo_drop(struct globalfifo_dev *dev, struct globalfifo_buf *buf,
+                                    unsigned int tail, unsigned int head, unsigned int room) {
+    struct globalfifo_pkt_hdr hdr;
+    unsigned int old = tail;
+    u64 records = 0;
+
+    if (buf->size - (head - tail) >= room)
+        return tail;
+
+    if (!(dev->flags & GLOBALFIFO_F_PACKET)) {
+        tail = head + room - buf->size;
+    } else {
+        while (buf->size - (head - tail) < room) {
+            globalfifo_peek(buf, tail, &hdr, sizeof(hdr));
+            // a broken record, drop everything behind it too
+            if (head - tail < sizeof(hdr) || hdr.len > head - tail - sizeof(hdr)) {
+                tail = head;
+                break;
+            }
+            tail += sizeof(hdr) + hdr.len;
+            records++;
+        }
+    }
+    atomic64_add(tail - old, &dev->dropped_bytes);
+    atomic64_add(records, &dev->dropped_records);
+    return tail;
+}
+
+// append at @head of @buf what the caller made room for, as one record in
+// packet mode. returns the bytes taken from @from and the new head in @new_head
+static ssize_t globalfifo_enqueue(struct globalfifo_dev *dev, struct globalfifo_buf *buf, struct iov_iter *from,
+                                  unsigned int head, size_t count, unsigned int *new_head) {
+    struct globalfifo_pkt_hdr hdr = { .len = count };
+    size_t copied;
+
+    if (!(dev->flags & GLOBALFIFO_F_PACKET)) {
+        copied = globalfifo_copy_in(buf, from, head, count);
+        if (!copied)
+            return -EFAULT;
+        *new_head = head + copied;
+        return copied;
+    }
+
+    // a record is only published whole, a short copy drops it
+    if (globalfifo_copy_in(buf, from, head + sizeof(hdr), count) != count)
+        return -EFAULT;
+    globalfifo_poke(buf, head, &hdr, sizeof(hdr));
+    *new_head = head + sizeof(hdr) + count;
+    return count;
+}
+
+// take data between @tail and @head of @buf out to @to. returns the bytes
+// given to the reader and the new tail in @new_tail
+static ssize_t globalfifo_dequeue(struct globalfifo_dev *dev, struct globalfifo_buf *buf, struct iov_iter *to,
+                                  unsigned int tail, unsigned int head, unsigned int *new_tail) {
+    size_t count = iov_iter_count(to);
+    struct globalfifo_pkt_hdr hdr;
+    size_t copied, done = 0;
+
+    if (!(dev->flags & GLOBALFIFO_F_PACKET)) {
+        copied = globalfifo_copy_out(buf, to, tail, min_t(size_t, count, head - tail));
+        if (!copied)
+            return -EFAULT;
+        *new_tail = tail + copied;
+        return copied;
+    }
+
+    while (tail != head) {
+        globalfifo_peek(buf, tail, &hdr, sizeof(hdr));
+        // the ring may have been written through the mapping
+        if (head - tail < sizeof(hdr) || hdr.len > head - tail - sizeof(hdr))
+            return done ? done : -EIO;
+
+        if (!(dev->flags & GLOBALFIFO_F_PACKET_BATCH)) {
+            // one record, the part that doesn't fit the read is discarded
+            copied = min_t(size_t, count, hdr.len);
+            if (globalfifo_copy_out(buf, to, tail + sizeof(hdr), copied) != copied)
+                return -EFAULT;
+            *new_tail = tail + sizeof(hdr) + hdr.len;
+            return copied;
+        }
+
+        // whole records with their headers, as many as fit
+        if (sizeof(hdr) + hdr.len > count - done)
+            break;
+        if (copy_to_iter(&hdr, sizeof(hdr), to) != sizeof(hdr) ||
+            globalfifo_copy_out(buf, to, tail + sizeof(hdr), hdr.len) != hdr.len)
+            return done ? done : -EFAULT;
+        done += sizeof(hdr) + hdr.len;
+        tail += sizeof(hdr) + hdr.len;
+        *new_tail = tail;
+    }
+    return done ? done : -EMSGSIZE;
+}
+
+// GLOBALFIFO_F_OVERWRITE writer of the ring or a shard, with nothing but
+// @lock: make room, dropping from @tail, and append. it never sleeps on
+// what a reader holds, the data goes in with page faults off and after a
+// short copy the user buffer is faulted in outside the lock (unless
+// @nowait) and the write tried again. returns 0 if overwrite mode was
+// switched off meanwhile, or the mode doesn't use @buf (for now), the
+// caller then goes the locked way. the change to the bytes queued is in
+// @delta, whatever the outcome
+static ssize_t globalfifo_ow_enqueue(struct globalfifo_dev *dev, struct globalfifo_buf *buf, spinlock_t *lock,
+                                     unsigned int *head, unsigned int *tail, struct globalfifo_stamps *stamps,
+                                     struct iov_iter *from, bool nowait, int *delta) {
+    size_t count = iov_iter_count(from);
+    struct iov_iter_state state;
+    unsigned int new_head, new_tail;
+    ssize_t ret;
+
+    *delta = 0;
+    iov_iter_save_state(from, &state);
+    for (;;) {
+        spin_lock(lock);
+        // FIFO_SET_FLAGS and FIFO_SET_MODE change them under dev->ow_lock.
+        // the latter holds the SPSC writer bit while it switches, and
+        // takes every shard's lock after leaving PERCPU mode
+        if (!(dev->flags & GLOBALFIFO_F_OVERWRITE) ||
+            (buf == &dev->buf) == (dev->mode == GLOBALFIFO_MODE_PERCPU) ||
+            (buf == &dev->buf && test_bit(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy))) {
+            spin_unlock(lock);
+            return 0;
+        }
+        if (globalfifo_need(dev, count) > buf->size) {
+            spin_unlock(lock);
+            return -EMSGSIZE;
+        }
+        count = min_t(size_t, count, buf->size);
+        new_tail = globalfifo_drop(dev, buf, *tail, *head, max_t(size_t, globalfifo_snd_want(dev, count), count));
+        *delta -= new_tail - *tail;
+        smp_store_release(tail, new_tail);
+        globalfifo_unstamp(dev, stamps, new_tail, false);
+        if (buf == &dev->buf && dev->mode == GLOBALFIFO_MODE_BROADCAST)
+            globalfifo_bcast_cut(dev);
+
+        pagefault_disable();
+        ret = globalfifo_enqueue(dev, buf, from, *head, count, &new_head);
+        pagefault_enable();
+        if (ret >= 0) {
+            *delta += new_head - *head;
+            smp_store_release(head, new_head);
+            if (dev->flags & GLOBALFIFO_F_TIMESTAMP)
+                globalfifo_stamp(stamps, new_head);
+            spin_unlock(lock);
+            return ret;
+        }
+        spin_unlock(lock);
+
+        // the room made above stays made, it was going to be needed
+        iov_iter_restore(from, &state);
+        if (nowait)
+            return -EAGAIN;
+        if (fault_in_iov_iter_readable(from, count) == count)
+            return -EFAULT;
+    }
+}
+
+// GLOBALFIFO_F_OVERWRITE readers take the data into a kernel buffer under
+// the writers' spinlock and only copy it to the user once that is dropped.
+// a byte stream goes in chunks, a record has to be taken whole
+static void *globalfifo_bounce_alloc(struct globalfifo_dev *dev, struct globalfifo_buf *buf, struct iov_iter *to,
+                                     struct kvec *kvec, struct iov_iter *iter, bool nowait) {
+    size_t len = min_t(size_t, iov_iter_count(to), READ_ONCE(buf->size));
+
+    if (!(dev->flags & GLOBALFIFO_F_PACKET))
+        len = min_t(size_t, len, GLOBALFIFO_OW_CHUNK);
+    kvec->iov_base = kvmalloc(len, nowait ? GFP_NOWAIT : GFP_KERNEL);
+    kvec->iov_len = len;
+    iov_iter_kvec(iter, ITER_DEST, kvec, 1, len);
+    return kvec->iov_base;
+}
+
+// hand what globalfifo_dequeue() put in @bounce to the reader. it has left
+// the FIFO already, what doesn't make it to the user counts as dropped
+static ssize_t globalfifo_bounce_out(struct globalfifo_dev *dev, void *bounce, ssize_t ret, struct iov_iter *to) {
+    size_t copied;
+
+    if (ret > 0) {
+        copied = copy_to_iter(bounce, ret, to);
+        if (copied != ret) {
+            atomic64_add(ret - copied, &dev->dropped_bytes);
+            ret = copied ? copied : -EFAULT;
+        }
+    }
+    kvfree(bounce);
+    return ret;
+}
+
+// GLOBALFIFO_F_OVERWRITE reader of the ring or a shard, with the reader
+// side's mutex held so only writers' drops move @tail besides us. returns
+// the bytes read and how far @tail moved in @taken
+static ssize_t globalfifo_ow_dequeue(struct globalfifo_dev *dev, struct globalfifo_buf *buf, spinlock_t *lock,
+                                     unsigned int *head, unsigned int *tail, struct globalfifo_stamps *stamps,
+                                     struct iov_iter *to, bool nowait, unsigned int *taken) {
+    struct iov_iter iter;
+    struct kvec kvec;
+    unsigned int next;
+    void *bounce;
+    ssize_t ret = -EAGAIN;
+
+    *taken = 0;
+    bounce = globalfifo_bounce_alloc(dev, buf, to, &kvec, &iter, nowait);
+    if (!bounce)
+        return nowait ? -EAGAIN : -ENOMEM;
+
+    spin_lock(lock);
+    if (*head != *tail)
+        ret = globalfifo_dequeue(dev, buf, &iter, *tail, *head, &next);
+    if (ret >= 0) {
+        *taken = next - *tail;
+        smp_store_release(tail, next);
+        globalfifo_unstamp(dev, stamps, next, true);
+    }
+    spin_unlock(lock);
+    return globalfifo_bounce_out(dev, bounce, ret, to);
+}
+
+// LOCKED and BROADCAST mode share the ring and its locked writer
+static bool globalfifo_ring_mode(struct globalfifo_dev *dev) {
+    return dev->mode == GLOBALFIFO_MODE_LOCKED || dev->mode == GLOBALFIFO_MODE_BROADCAST;
+}
+
+// free bytes for a LOCKED mode writer
+static unsigned int globalfifo_room(struct globalfifo_dev *dev) {
+    return READ_ONCE(dev->buf.size) - (READ_ONCE(dev->ring->head) - READ_ONCE(dev->ring->tail));
+}
+
+// O_NONBLOCK on the file or IOCB_NOWAIT from io_uring/preadv2(RWF_NOWAIT)
+static bool globalfifo_nowait(struct kiocb *iocb) {
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// arm the wakeup hint for producers writing through the mapping, then
+// check for data. the full barrier pairs with theirs between moving head
+// and reading flags
+static bool globalfifo_ring_readable(struct globalfifo_ring *ring, unsigned int tail, unsigned int want) {
+    atomic_or(GLOBALFIFO_RING_READER_WAITING, &ring->flags);
+    smp_mb__after_atomic();
+    return smp_load_acquire(&ring->head) - tail >= want;
+}
+
+// the size comes from dev, ring->size is only a copy for the mapping
+static bool globalfifo_ring_writable(struct globalfifo_dev *dev, unsigned int head, unsigned int need) {
+    atomic_or(GLOBALFIFO_RING_WRITER_WAITING, &dev->ring->flags);
+    smp_mb__after_atomic();
+    return dev->buf.size - (head - smp_load_acquire(&dev->ring->tail)) >= need;
+}
+
+// wake the sleepers of one side and drop its hint, they re-arm it if they
+// go back to sleep
+static void globalfifo_ring_wake(struct globalfifo_dev *dev, int flag, wait_queue_head_t *q) {
+    if (wq_has_sleeper(q)) {
+        atomic_andnot(flag, &dev->ring->flags);
+        wake_up_interruptible(q);
+    }
+}
+
+// a read or write that finds the mode changed under it starts over
+static ssize_t globalfifo_do_read(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t globalfifo_do_write(struct kiocb *iocb, struct iov_iter *from);
+
+// SPSC mode: head and tail are handed over with acquire/release instead
+// of dev->mutex, the wait queues are only touched to sleep when empty/full
+static ssize_t globalfifo_spsc_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(to);
+    unsigned int head, tail, want, size;
+    ssize_t ret = 0;
+
+    if (!count)
+        return 0;
+    want = globalfifo_rcv_want(dev);
+    if (test_and_set_bit_lock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy))
+        return -EBUSY;
+    // FIFO_SET_MODE holds our bit while it switches
+    if (READ_ONCE(dev->mode) != GLOBALFIFO_MODE_SPSC) {
+        clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+        return globalfifo_do_read(iocb, to);
+    }
+    // a resize waits for our bit
+    size = dev->buf.size;
+
+    // only we move tail, the acquire on head makes the data behind it visible
+    tail = READ_ONCE(dev->ring->tail);
+    while ((head = smp_load_acquire(&dev->ring->head)) - tail < want) {
+        if (globalfifo_nowait(iocb)) {
+            // without blocking, whatever is there will do
+            if (head != tail)
+                break;
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (globalfifo_wait(dev, false, wait_event_interruptible(dev->r_wait, globalfifo_ring_readable(dev->ring, tail, want)))) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+    }
+    // the indices may come from user space through the mapping
+    if (head - tail > size) {
+        ret = -EIO;
+        goto out;
+    }
+
+    ret = globalfifo_dequeue(dev, &dev->buf, to, tail, head, &tail);
+    if (ret < 0)
+        goto out;
+    // the writer may reuse the space once it sees the new tail
+    smp_store_release(&dev->ring->tail, tail);
+    // pairs with the barrier in the writer's wait_event(). writers only
+    // care once sndlowat bytes are free
+    if (size - (head - tail) >= READ_ONCE(dev->sndlowat)) {
+        globalfifo_ring_wake(dev, GLOBALFIFO_RING_WRITER_WAITING, &dev->w_wait);
+        globalfifo_notify(dev, POLL_OUT);
+    }
+
+out:
+    clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+    return ret;
+}
+
+static ssize_t globalfifo_spsc_write(struct kiocb *iocb, struct iov_iter *from) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    unsigned int head, tail, need, want, size;
+    ssize_t ret = 0;
+
+    if (!count)
+        return 0;
+    need = globalfifo_need(dev, count);
+    want = globalfifo_snd_want(dev, count);
+    if (test_and_set_bit_lock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy))
+        return -EBUSY;
+    if (READ_ONCE(dev->mode) != GLOBALFIFO_MODE_SPSC) {
+        clear_bit_unlock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy);
+        return globalfifo_do_write(iocb, from);
+    }
+    // a resize waits for our bit
+    size = dev->buf.size;
+    if (need > size) {
+        ret = -EMSGSIZE;
+        goto out;
+    }
+
+    // only we move head, the acquire on tail orders our stores after the
+    // reader is done with the space
+    head = READ_ONCE(dev->ring->head);
+    while (size - (head - (tail = smp_load_acquire(&dev->ring->tail))) < want) {
+        if (globalfifo_nowait(iocb)) {
+            if (size - (head - tail) >= need)
+                break;
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (globalfifo_wait(dev, true, wait_event_interruptible(dev->w_wait, globalfifo_ring_writable(dev, head, want)))) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+    }
+    if (head - tail > size) {
+        ret = -EIO;
+        goto out;
+    }
+
+    count = min_t(size_t, count, size - (head - tail));
+    ret = globalfifo_enqueue(dev, &dev->buf, from, head, count, &head);
+    if (ret < 0)
+        goto out;
+    // publish the data together with the new head
+    smp_store_release(&dev->ring->head, head);
+    // readers only care once rcvlowat bytes are queued
+    if (head - tail >= READ_ONCE(dev->rcvlowat)) {
+        globalfifo_ring_wake(dev, GLOBALFIFO_RING_READER_WAITING, &dev->r_wait);
+        globalfifo_notify(dev, POLL_IN);
+    }
+
+out:
+    clear_bit_unlock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy);
+    return ret;
+}
+
+static void globalfifo_pcpu_free(struct globalfifo_shard __percpu *shards) {
+    int cpu;
+
+    if (!shards)
+        return;
+    for_each_possible_cpu(cpu)
+        globalfifo_buf_free(&per_cpu_ptr(shards, cpu)->buf);
+    free_percpu(shards);
+}
+
+// shards for every possible CPU, so hotplug never strands queued data
+static int globalfifo_pcpu_alloc(struct globalfifo_dev *dev) {
+    struct globalfifo_shard __percpu *shards;
+    int cpu;
+
+    if (dev->shards)
+        return 0;
+    shards = alloc_percpu(struct globalfifo_shard);
+    if (!shards)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        struct globalfifo_shard *shard = per_cpu_ptr(shards, cpu);
+
+        mutex_init(&shard->lock);
+        spin_lock_init(&shard->ow_lock);
+        init_waitqueue_head(&shard->w_wait);
+        if (globalfifo_buf_alloc(&shard->buf, GLOBALFIFO_SIZE, cpu_to_node(cpu))) {
+            globalfifo_pcpu_free(shards);
+            return -ENOMEM;
+        }
+    }
+    dev->shards = shards;
+    return 0;
+}
+
+// the shard a file writes to, picked once so its data can't be reordered
+// by a migration between two writes
+static struct globalfifo_shard *globalfifo_pcpu_home(struct file *filp) {
+    struct globalfifo_file *gf = filp->private_data;
+
+    if (READ_ONCE(gf->shard) < 0)
+        cmpxchg(&gf->shard, -1, raw_smp_processor_id());
+    return per_cpu_ptr(gf->dev->shards, READ_ONCE(gf->shard));
+}
+
+static unsigned int globalfifo_shard_free(struct globalfifo_shard *shard) {
+    return shard->buf.size - (READ_ONCE(shard->head) - READ_ONCE(shard->tail));
+}
+
+// take from the local shard, else steal from the next non-empty one.
+// -EAGAIN if every shard was empty (or locked, without blocking)
+static ssize_t globalfifo_pcpu_dequeue(struct globalfifo_dev *dev, struct iov_iter *to, bool nowait) {
+    int start = raw_smp_processor_id();
+    unsigned int i, tail, free;
+    ssize_t ret;
+
+    for (i = 0; i < nr_cpu_ids; ++i) {
+        int cpu = (start + i) % nr_cpu_ids;
+        struct globalfifo_shard *shard;
+
+        if (!cpu_possible(cpu))
+            continue;
+        shard = per_cpu_ptr(dev->shards, cpu);
+        // don't bounce the lock of a shard there is nothing to take from
+        if (READ_ONCE(shard->head) == READ_ONCE(shard->tail))
+            continue;
+        if (nowait) {
+            if (!mutex_trylock(&shard->lock))
+                continue;
+        } else {
+            mutex_lock(&shard->lock);
+        }
+        if (shard->head == shard->tail) {
+            mutex_unlock(&shard->lock);
+            continue;
+        }
+
+        if (dev->flags & GLOBALFIFO_F_OVERWRITE) {
+            // the shard's writers only take ow_lock, nobody waits for room
+            ret = globalfifo_ow_dequeue(dev, &shard->buf, &shard->ow_lock, &shard->head, &shard->tail,
+                                        &shard->stamps, to, nowait, &tail);
+            atomic_sub(tail, &dev->pcpu_len);
+            mutex_unlock(&shard->lock);
+            return ret;
+        }
+        ret = globalfifo_dequeue(dev, &shard->buf, to, shard->tail, shard->head, &tail);
+        if (ret >= 0) {
+            atomic_sub(tail - shard->tail, &dev->pcpu_len);
+            WRITE_ONCE(shard->tail, tail);
+            globalfifo_unstamp(dev, &shard->stamps, tail, true);
+        }
+        free = shard->buf.size - (shard->head - shard->tail);
+        mutex_unlock(&shard->lock);
+        // writers only care once sndlowat bytes are free
+        if (ret >= 0 && free >= READ_ONCE(dev->sndlowat)) {
+            wake_up_interruptible(&shard->w_wait);
+            globalfifo_notify(dev, POLL_OUT);
+        }
+        return ret;
+    }
+    return -EAGAIN;
+}
+
+// PERCPU mode: readers wait on the total over all shards, then race each
+// other for a shard
+static ssize_t globalfifo_pcpu_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
+    unsigned int want = globalfifo_rcv_want(dev);
+    bool nowait = globalfifo_nowait(iocb);
+    ssize_t ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    for (;;) {
+        if (READ_ONCE(dev->mode) != GLOBALFIFO_MODE_PERCPU)
+            return globalfifo_do_read(iocb, to);
+        if (nowait || atomic_read(&dev->pcpu_len) >= want) {
+            // without blocking, whatever is there will do
+            ret = globalfifo_pcpu_dequeue(dev, to, iocb->ki_flags & IOCB_NOWAIT);
+            if (ret != -EAGAIN || nowait)
+                break;
+            // another reader got there first
+        }
+        if (globalfifo_wait(dev, false,
+                            wait_event_interruptible_exclusive(dev->r_wait, atomic_read(&dev->pcpu_len) >= want ||
+                                                               READ_ONCE(dev->mode) != GLOBALFIFO_MODE_PERCPU))) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+    }
+
+    // one reader is woken per wakeup, hand it on while there is more to
+    // read, also if a signal made us drop the one we took
+    if (atomic_read(&dev->pcpu_len) >= READ_ONCE(dev->rcvlowat) && wq_has_sleeper(&dev->r_wait))
+        wake_up_interruptible(&dev->r_wait);
+    return ret;
+}
+
+static ssize_t globalfifo_pcpu_write(struct kiocb *iocb, struct iov_iter *from) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
+    struct globalfifo_shard *shard = globalfifo_pcpu_home(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    unsigned int head, need, want, len;
+    ssize_t ret;
+    int delta;
+
+    if (!count)
+        return 0;
+    // never wait, take the room from the oldest data, and stay off the
+    // shard lock a reader may hold for as long as it likes
+    if (READ_ONCE(dev->flags) & GLOBALFIFO_F_OVERWRITE) {
+        ret = globalfifo_ow_enqueue(dev, &shard->buf, &shard->ow_lock, &shard->head, &shard->tail,
+                                    &shard->stamps, from, iocb->ki_flags & IOCB_NOWAIT, &delta);
+        len = atomic_add_return(delta, &dev->pcpu_len);
+        if (ret > 0 && len >= READ_ONCE(dev->rcvlowat)) {
+            wake_up_interruptible(&dev->r_wait);
+            globalfifo_notify(dev, POLL_IN);
+        }
+        if (ret)
+            return ret;
+    }
+    need = globalfifo_need(dev, count);
+    if (need > shard->buf.size)
+        return -EMSGSIZE;
+    want = globalfifo_snd_want(dev, count);
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&shard->lock))
+            return -EAGAIN;
+    } else {
+        mutex_lock(&shard->lock);
+    }
+    while (globalfifo_shard_free(shard) < want && READ_ONCE(dev->mode) == GLOBALFIFO_MODE_PERCPU) {
+        if (globalfifo_nowait(iocb)) {
+            if (globalfifo_shard_free(shard) >= need)
+                break;
+            mutex_unlock(&shard->lock);
+            return -EAGAIN;
+        }
+        mutex_unlock(&shard->lock);
+        if (globalfifo_wait(dev, true,
+                            wait_event_interruptible_exclusive(shard->w_wait, globalfifo_shard_free(shard) >= want ||
+                                                               READ_ONCE(dev->mode) != GLOBALFIFO_MODE_PERCPU))) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+        mutex_lock(&shard->lock);
+    }
+    // FIFO_SET_MODE takes every shard lock after leaving PERCPU mode, so
+    // from here on the data can't be stranded in the shard
+    if (READ_ONCE(dev->mode) != GLOBALFIFO_MODE_PERCPU) {
+        mutex_unlock(&shard->lock);
+        return globalfifo_do_write(iocb, from);
+    }
+
+    count = min_t(size_t, count, globalfifo_shard_free(shard));
+    ret = globalfifo_enqueue(dev, &shard->buf, from, shard->head, count, &head);
+    if (ret < 0) {
+        mutex_unlock(&shard->lock);
+        goto out;
+    }
+    // head first, so a reader that sees the new total also finds the data
+    len = head - shard->head;
+    WRITE_ONCE(shard->head, head);
+    if (dev->flags & GLOBALFIFO_F_TIMESTAMP)
+        globalfifo_stamp(&shard->stamps, head);
+    len = atomic_add_return(len, &dev->pcpu_len);
+    mutex_unlock(&shard->lock);
+    // readers only care once rcvlowat bytes are queued
+    if (len >= READ_ONCE(dev->rcvlowat)) {
+        wake_up_interruptible(&dev->r_wait);
+        globalfifo_notify(dev, POLL_IN);
+    }
+
+out:
+    // same hand-on as for readers, the next writer of this shard may fit
+    if (globalfifo_shard_free(shard) >= READ_ONCE(dev->sndlowat) && wq_has_sleeper(&shard->w_wait))
+        wake_up_interruptible(&shard->w_wait);
+    return ret;
+}
+
+// writers of the ring and of every shard, for changes that may let any of
+// them go on rather than the one a read made room for
+static void globalfifo_wake_writers_all(struct globalfifo_dev *dev) {
+    int cpu;
+
+    wake_up_interruptible_all(&dev->w_wait);
+    globalfifo_notify(dev, POLL_OUT);
+    if (!dev->shards)
+        return;
+    for_each_possible_cpu(cpu)
+        wake_up_interruptible_all(&per_cpu_ptr(dev->shards, cpu)->w_wait);
+}
+
+// after leaving PERCPU mode: wait for the shard writers that got in before
+// the switch. false if one of them queued data meanwhile
+static bool globalfifo_pcpu_quiesce(struct globalfifo_dev *dev) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct globalfifo_shard *shard = per_cpu_ptr(dev->shards, cpu);
+
+        mutex_lock(&shard->lock);
+        spin_lock(&shard->ow_lock);
+        spin_unlock(&shard->ow_lock);
+        mutex_unlock(&shard->lock);
+    }
+    return !atomic_read(&dev->pcpu_len);
+}
+
+// drop everything queued in the shards
+static void globalfifo_pcpu_clear(struct globalfifo_dev *dev) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct globalfifo_shard *shard = per_cpu_ptr(dev->shards, cpu);
+
+        mutex_lock(&shard->lock);
+        spin_lock(&shard->ow_lock);
+        atomic_sub(shard->head - shard->tail, &dev->pcpu_len);
+        WRITE_ONCE(shard->tail, shard->head);
+        globalfifo_unstamp(dev, &shard->stamps, shard->head, false);
+        spin_unlock(&shard->ow_lock);
+        mutex_unlock(&shard->lock);
+    }
+}
+
+// BROADCAST mode with overwrite, dev->mutex held: the writers cut cursors
+// off under dev->ow_lock, so the lag is checked and the cursor moved under
+// it, the data handed out after. no writer waits for room
+static ssize_t globalfifo_bcast_ow_read(struct globalfifo_dev *dev, struct globalfifo_file *gf,
+                                        struct iov_iter *to, bool nowait) {
+    struct iov_iter iter;
+    struct kvec kvec;
+    unsigned int cursor, tail;
+    void *bounce;
+    ssize_t ret;
+
+    bounce = globalfifo_bounce_alloc(dev, &dev->buf, to, &kvec, &iter, nowait);
+    if (!bounce)
+        return nowait ? -EAGAIN : -ENOMEM;
+
+    spin_lock(&dev->ow_lock);
+    if (gf->lagged) {
+        // cut off while we waited for the lock
+        WRITE_ONCE(gf->lagged, false);
+        ret = -EPIPE;
+    } else if (gf->cursor == dev->ring->head) {
+        ret = -EAGAIN;
+    } else {
+        ret = globalfifo_dequeue(dev, &dev->buf, &iter, gf->cursor, dev->ring->head, &cursor);
+        if (ret >= 0) {
+            tail = gf->cursor;
+            gf->cursor = cursor;
+            // only the slowest reader moving on frees anything
+            if (tail == dev->ring->tail)
+                smp_store_release(&dev->ring->tail, globalfifo_bcast_tail(dev));
+        }
+    }
+    spin_unlock(&dev->ow_lock);
+    return globalfifo_bounce_out(dev, bounce, ret, to);
+}
+
+// BROADCAST mode: read from our own cursor. readers don't wait exclusive
+// here, a write is news to every one of them
+static ssize_t globalfifo_bcast_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct globalfifo_file *gf = iocb->ki_filp->private_data;
+    struct globalfifo_dev *dev = gf->dev;
+    unsigned int want = globalfifo_rcv_want(dev);
+    unsigned int cursor, tail;
+    ssize_t ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&dev->mutex))
+            return -EAGAIN;
+    } else {
+        mutex_lock(&dev->mutex);
+    }
+    while (dev->mode == GLOBALFIFO_MODE_BROADCAST && !gf->lagged && dev->ring->head - gf->cursor < want) {
+        if (globalfifo_nowait(iocb)) {
+            // without blocking, whatever is there will do
+            if (dev->ring->head != gf->cursor)
+                break;
+            ret = -EAGAIN;
+            goto out;
+        }
+        mutex_unlock(&dev->mutex);
+        if (globalfifo_wait(dev, false,
+                            wait_event_interruptible(dev->r_wait, READ_ONCE(gf->lagged) ||
+                                                     READ_ONCE(dev->ring->head) - READ_ONCE(gf->cursor) >= want ||
+                                                     READ_ONCE(dev->mode) != GLOBALFIFO_MODE_BROADCAST)))
+            return -ERESTARTSYS;
+        mutex_lock(&dev->mutex);
+    }
+    // the mode may have changed while we slept
+    if (dev->mode != GLOBALFIFO_MODE_BROADCAST) {
+        mutex_unlock(&dev->mutex);
+        return globalfifo_do_read(iocb, to);
+    }
+    if (dev->flags & GLOBALFIFO_F_OVERWRITE) {
+        ret = globalfifo_bcast_ow_read(dev, gf, to, iocb->ki_flags & IOCB_NOWAIT);
+        goto out;
+    }
+    if (gf->lagged) {
+        WRITE_ONCE(gf->lagged, false);
+        ret = -EPIPE;
+        goto out;
+    }
+
+    ret = globalfifo_dequeue(dev, &dev->buf, to, gf->cursor, dev->ring->head, &cursor);
+    if (ret < 0)
+        goto out;
+    tail = gf->cursor;
+    gf->cursor = cursor;
+    // only the slowest reader moving on frees anything
+    if (tail == dev->ring->tail) {
+        tail = globalfifo_bcast_tail(dev);
+        smp_store_release(&dev->ring->tail, tail);
+        if (dev->buf.size - (dev->ring->head - tail) >= dev->sndlowat) {
+            wake_up_interruptible(&dev->w_wait);
+            globalfifo_notify(dev, POLL_OUT);
+        }
+    }
+
+out:
+    mutex_unlock(&dev->mutex);
+    return ret;
 }
 
-static ssize_t globalfifo_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos) {
-    // unsigned long p = *ppos;
-    // unsigned int count = size;
-    int ret = 0;
+// LOCKED mode reader
+static ssize_t globalfifo_locked_read(struct kiocb *iocb, struct iov_iter *to) {
+    unsigned int tail, want;
+    ssize_t ret = 0;
     // get device from file struct
-    struct globalfifo_dev *dev = filp->private_data;
-    DECLARE_WAITQUEUE(wait, current);
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
 
-    mutex_lock(&dev->mutex);
-    add_wait_queue(&dev->r_wait, &wait);
+    if (!iov_iter_count(to))
+        return 0;
 
-    while (dev->current_len == 0) {
-        if (filp->f_flags & O_NONBLOCK) {
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&dev->mutex))
+            return -EAGAIN;
+    } else {
+        mutex_lock(&dev->mutex);
+    }
+
+    want = globalfifo_rcv_want(dev);
+    while (dev->mode == GLOBALFIFO_MODE_LOCKED && dev->ring->head - dev->ring->tail < want) {
+        if (globalfifo_nowait(iocb)) {
+            // without blocking, whatever is there will do
+            if (dev->ring->head != dev->ring->tail)
+                break;
             ret = -EAGAIN;
             goto out;
         }
-        __set_current_state(TASK_INTERRUPTIBLE);
         mutex_unlock(&dev->mutex);
-        schedule();  // sleep, release mutex before that
-        if (signal_pending(current)) {
+        // exclusive, a wakeup goes to one reader instead of the whole
+        // pool. the condition is tested after queueing, overwrite writers
+        // publish data and wake us without the mutex
+        if (globalfifo_wait(dev, false,
+                            wait_event_interruptible_exclusive(dev->r_wait, globalfifo_len(dev) >= want ||
+                                                               READ_ONCE(dev->mode) != GLOBALFIFO_MODE_LOCKED))) {
             ret = -ERESTARTSYS;
             goto out2;
         }
-        
         mutex_lock(&dev->mutex);
     }
+    // the mode may have changed while we slept
+    if (dev->mode != GLOBALFIFO_MODE_LOCKED) {
+        mutex_unlock(&dev->mutex);
+        return globalfifo_do_read(iocb, to);
+    }
     
-    // get count of readable
-    if (count > dev->current_len)
-        count = dev->current_len;
+    // overwrite writers don't wait for the mutex, take it from under them
+    if (dev->flags & GLOBALFIFO_F_OVERWRITE) {
+        ret = globalfifo_ow_dequeue(dev, &dev->buf, &dev->ow_lock, &dev->ring->head, &dev->ring->tail,
+                                    &dev->stamps, to, iocb->ki_flags & IOCB_NOWAIT, &tail);
+        goto out;
+    }
 
-    // copy data from device to user space
-    if (copy_to_user(buf, dev->mem, count)) {
-        ret = -EFAULT;
+    // copy data from device to every user segment in one locked section
+    ret = globalfifo_dequeue(dev, &dev->buf, to, dev->ring->tail, dev->ring->head, &tail);
+    if (ret < 0) {
         goto out;
     } else {
-        // move the rest
-        memcpy(dev->mem, dev->mem+count, dev->current_len - count);
-        dev->current_len -= count;
-        printk(KERN_INFO "read %zu bytes(s), current_len: %u\n", count, dev->current_len);
-        wake_up_interruptible(&dev->w_wait);
-        ret = count;
+        // only the consumed bytes cost anything, nothing is moved
+        smp_store_release(&dev->ring->tail, tail);
+        globalfifo_unstamp(dev, &dev->stamps, tail, true);
+        // writers only care once sndlowat bytes are free
+        if (dev->buf.size - (dev->ring->head - tail) >= dev->sndlowat) {
+            wake_up_interruptible(&dev->w_wait);
+            globalfifo_notify(dev, POLL_OUT);
+        }
     }
 
     out:
     mutex_unlock(&dev->mutex);
 
     out2:
-    remove_wait_queue(&dev->w_wait, &wait);
-    set_current_state(TASK_RUNNING);
+    // hand the wakeup on while there is more to read, also if a signal
+    // made us drop the one we took
+    if (globalfifo_len(dev) >= READ_ONCE(dev->rcvlowat) && wq_has_sleeper(&dev->r_wait))
+        wake_up_interruptible(&dev->r_wait);
 
     return ret;
 }
 
-static ssize_t globalfifo_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos) {
-    int ret = 0;
+static ssize_t globalfifo_do_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
+
+    if (READ_ONCE(dev->mode) == GLOBALFIFO_MODE_SPSC)
+        return globalfifo_spsc_read(iocb, to);
+    if (READ_ONCE(dev->mode) == GLOBALFIFO_MODE_PERCPU)
+        return globalfifo_pcpu_read(iocb, to);
+    if (READ_ONCE(dev->mode) == GLOBALFIFO_MODE_BROADCAST)
+        return globalfifo_bcast_read(iocb, to);
+    return globalfifo_locked_read(iocb, to);
+}
+
+static ssize_t globalfifo_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    ssize_t ret = globalfifo_do_read(iocb, to);
+
+    globalfifo_account(globalfifo_filp_dev(iocb->ki_filp), false, ret);
+    return ret;
+}
+
+// LOCKED and BROADCAST mode writer
+static ssize_t globalfifo_locked_write(struct kiocb *iocb, struct iov_iter *from) {
+    size_t count = iov_iter_count(from);
+    unsigned int head, need, want;
+    ssize_t ret = 0;
+    int delta;
     // get device from file struct
-    struct globalfifo_dev *dev = filp->private_data;
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
     DECLARE_WAITQUEUE(wait, current);
 
-    mutex_lock(&dev->mutex);
-    add_wait_queue(&dev->w_wait, &wait);
+    if (!count)
+        return 0;
+
+    // never wait, take the room from the oldest data. readers hold the
+    // mutex as long as they like, so stay off it
+    if (READ_ONCE(dev->flags) & GLOBALFIFO_F_OVERWRITE) {
+        ret = globalfifo_ow_enqueue(dev, &dev->buf, &dev->ow_lock, &dev->ring->head, &dev->ring->tail,
+                                    &dev->stamps, from, iocb->ki_flags & IOCB_NOWAIT, &delta);
+        // readers only care once rcvlowat bytes are queued
+        if (ret > 0 && globalfifo_len(dev) >= READ_ONCE(dev->rcvlowat)) {
+            wake_up_interruptible(&dev->r_wait);
+            globalfifo_notify(dev, POLL_IN);
+        }
+        if (ret)
+            return ret;
+    }
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&dev->mutex))
+            return -EAGAIN;
+    } else {
+        mutex_lock(&dev->mutex);
+    }
+    // overwrite mode or the mode may have been switched meanwhile
+    if ((dev->flags & GLOBALFIFO_F_OVERWRITE) || !globalfifo_ring_mode(dev)) {
+        mutex_unlock(&dev->mutex);
+        return globalfifo_do_write(iocb, from);
+    }
+    add_wait_queue_exclusive(&dev->w_wait, &wait);
 
-    while (dev->current_len == GLOBALFIFO_SIZE) {
-        if (filp->f_flags & O_NONBLOCK) {
+    need = globalfifo_need(dev, count);
+    if (need > dev->buf.size) {
+        ret = -EMSGSIZE;
+        goto out;
+    }
+    want = globalfifo_snd_want(dev, count);
+    if (dev->mode == GLOBALFIFO_MODE_BROADCAST)
+        globalfifo_bcast_cut(dev);
+    while (globalfifo_room(dev) < want && globalfifo_ring_mode(dev)) {
+        if (globalfifo_nowait(iocb)) {
+            if (globalfifo_room(dev) >= need)
+                break;
             ret = -EAGAIN;
             goto out;
         }
         __set_current_state(TASK_INTERRUPTIBLE);
         mutex_unlock(&dev->mutex);
+        globalfifo_wait_begin(dev, true);
         schedule();
+        globalfifo_wait_end(dev, true);
         if (signal_pending(current)) {
             ret = -ERESTARTSYS;
             goto out2;
@@ -88,19 +1261,37 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf, size_
         
         mutex_lock(&dev->mutex);
     }
+    if (!globalfifo_ring_mode(dev)) {
+        mutex_unlock(&dev->mutex);
+        remove_wait_queue(&dev->w_wait, &wait);
+        return globalfifo_do_write(iocb, from);
+    }
     
-    // get count of readable
-    if (count > GLOBALFIFO_SIZE - dev->current_len)
-        count = GLOBALFIFO_SIZE - dev->current_len;
+    // get count of writable
+    if (count > globalfifo_room(dev))
+        count = globalfifo_room(dev);
 
-    if (copy_from_user(dev->mem+dev->current_len, buf, count)) {
-        ret = -EFAULT;
+    // the header too in packet mode
+    ret = globalfifo_unshare(&dev->buf, dev->ring->head,
+                             count + (dev->flags & GLOBALFIFO_F_PACKET ? sizeof(struct globalfifo_pkt_hdr) : 0),
+                             dev->node, iocb->ki_flags & IOCB_NOWAIT ? GFP_NOWAIT : GFP_KERNEL);
+    if (ret) {
+        if (iocb->ki_flags & IOCB_NOWAIT)
+            ret = -EAGAIN;
+        goto out;
+    }
+    ret = globalfifo_enqueue(dev, &dev->buf, from, dev->ring->head, count, &head);
+    if (ret < 0) {
         goto out;
     } else {
-        dev->current_len += count;
-        printk(KERN_INFO "written %zu bytes(s), current_len: %u\n", count, dev->current_len);
-        wake_up_interruptible(&dev->r_wait);
-        ret = count;
+        smp_store_release(&dev->ring->head, head);
+        if (dev->flags & GLOBALFIFO_F_TIMESTAMP)
+            globalfifo_stamp(&dev->stamps, head);
+        // readers only care once rcvlowat bytes are queued
+        if (head - dev->ring->tail >= dev->rcvlowat) {
+            wake_up_interruptible(&dev->r_wait);
+            globalfifo_notify(dev, POLL_IN);
+        }
     }
 
     out:
@@ -109,7 +1300,137 @@ static ssize_t globalfifo_write(struct file *filp, const char __user *buf, size_
     out2:
     remove_wait_queue(&dev->w_wait, &wait);
     set_current_state(TASK_RUNNING);
+    if (globalfifo_room(dev) >= READ_ONCE(dev->sndlowat) && wq_has_sleeper(&dev->w_wait))
+        wake_up_interruptible(&dev->w_wait);
+
+    return ret;
+}
+
+static ssize_t globalfifo_do_write(struct kiocb *iocb, struct iov_iter *from) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(iocb->ki_filp);
+
+    if (READ_ONCE(dev->mode) == GLOBALFIFO_MODE_SPSC)
+        return globalfifo_spsc_write(iocb, from);
+    if (READ_ONCE(dev->mode) == GLOBALFIFO_MODE_PERCPU)
+        return globalfifo_pcpu_write(iocb, from);
+    return globalfifo_locked_write(iocb, from);
+}
+
+static ssize_t globalfifo_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    ssize_t ret = globalfifo_do_write(iocb, from);
+
+    globalfifo_account(globalfifo_filp_dev(iocb->ki_filp), true, ret);
+    return ret;
+}
+
+// a pipe buffer lending one of the ring pages. the ring keeps its own
+// reference, writers copy the page away while anybody else holds one, see
+// globalfifo_unshare()
+static void globalfifo_pipe_buf_release(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+    put_page(buf->page);
+    // the pipe may outlive every file of ours
+    module_put(THIS_MODULE);
+}
 
+// tee() duplicating one of our buffers
+static bool globalfifo_pipe_buf_get(struct pipe_inode_info *pipe, struct pipe_buffer *buf) {
+    if (!try_get_page(buf->page))
+        return false;
+    __module_get(THIS_MODULE);
+    return true;
+}
+
+// no .try_steal, the pages stay part of the ring
+static const struct pipe_buf_operations globalfifo_pipe_buf_ops = {
+    .release = globalfifo_pipe_buf_release,
+    .get = globalfifo_pipe_buf_get,
+};
+
+// hand up to @len queued bytes to @pipe as references to the ring pages.
+// the data counts as read and its space goes back to the writers right
+// away, they don't write into a page the pipe or whoever it passed the
+// page on to still holds
+static ssize_t globalfifo_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                                      size_t len, unsigned int flags) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(in);
+    bool nowait = (in->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK);
+    unsigned int tail, want;
+    size_t avail, done = 0;
+    ssize_t ret = 0;
+
+    // only the locked writer of the ring unshares a page before writing
+    // to it. shard writers don't look at page references, the SPSC ring
+    // may be mapped, packet framing needs read(), and overwrite mode
+    // writers can't stop to copy a page away
+    if (READ_ONCE(dev->mode) != GLOBALFIFO_MODE_LOCKED ||
+        (READ_ONCE(dev->flags) & (GLOBALFIFO_F_PACKET | GLOBALFIFO_F_OVERWRITE)))
+        return copy_splice_read(in, ppos, pipe, len, flags);
+    if (!len)
+        return 0;
+
+    want = globalfifo_rcv_want(dev);
+    mutex_lock(&dev->mutex);
+    while (dev->mode == GLOBALFIFO_MODE_LOCKED && dev->ring->head - dev->ring->tail < want) {
+        // without blocking, whatever is there will do
+        if (nowait && dev->ring->head != dev->ring->tail)
+            break;
+        mutex_unlock(&dev->mutex);
+        if (nowait) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (globalfifo_wait(dev, false,
+                            wait_event_interruptible_exclusive(dev->r_wait, globalfifo_len(dev) >= want ||
+                                                               READ_ONCE(dev->mode) != GLOBALFIFO_MODE_LOCKED))) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+        mutex_lock(&dev->mutex);
+    }
+    // another thread sharing our file may have switched modes meanwhile
+    if (dev->mode != GLOBALFIFO_MODE_LOCKED ||
+        (dev->flags & (GLOBALFIFO_F_PACKET | GLOBALFIFO_F_OVERWRITE))) {
+        mutex_unlock(&dev->mutex);
+        return copy_splice_read(in, ppos, pipe, len, flags);
+    }
+
+    tail = dev->ring->tail;
+    avail = min_t(size_t, len, dev->ring->head - tail);
+    while (done < avail && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+        unsigned int off = (tail + done) & (dev->buf.size - 1);
+        struct pipe_buffer *buf = &pipe->bufs[pipe->head & (pipe->ring_size - 1)];
+        size_t chunk = min_t(size_t, avail - done, PAGE_SIZE - offset_in_page(off));
+
+        // the ring is made of whole pages, they go to the pipe as they are
+        *buf = (struct pipe_buffer) {
+            .page = dev->buf.pages[off >> PAGE_SHIFT],
+            .offset = offset_in_page(off),
+            .len = chunk,
+            .ops = &globalfifo_pipe_buf_ops,
+        };
+        get_page(buf->page);
+        __module_get(THIS_MODULE);
+        pipe->head++;
+        done += chunk;
+    }
+
+    if (done) {
+        smp_store_release(&dev->ring->tail, tail + done);
+        globalfifo_unstamp(dev, &dev->stamps, tail + done, true);
+        if (dev->buf.size - (dev->ring->head - dev->ring->tail) >= dev->sndlowat) {
+            wake_up_interruptible(&dev->w_wait);
+            globalfifo_notify(dev, POLL_OUT);
+        }
+    }
+    mutex_unlock(&dev->mutex);
+    ret = done;
+
+out:
+    // the copying fallbacks above were counted by read_iter
+    globalfifo_account(dev, false, ret);
+    // the same hand-on as read()
+    if (globalfifo_len(dev) >= READ_ONCE(dev->rcvlowat) && wq_has_sleeper(&dev->r_wait))
+        wake_up_interruptible(&dev->r_wait);
     return ret;
 }
 
@@ -147,114 +1468,719 @@ static loff_t globalfifo_llseek(struct file *filp, loff_t offset, int orig) {
     return ret;
 }
 
+// most bytes a single queue of @dev holds, the bound for the watermarks
+static unsigned int globalfifo_capacity(struct globalfifo_dev *dev) {
+    return dev->mode == GLOBALFIFO_MODE_PERCPU ? GLOBALFIFO_SIZE : dev->buf.size;
+}
+
+// keep the watermarks reachable once the capacity shrank
+static void globalfifo_clamp_lowat(struct globalfifo_dev *dev) {
+    WRITE_ONCE(dev->rcvlowat, min(dev->rcvlowat, globalfifo_capacity(dev)));
+    WRITE_ONCE(dev->sndlowat, min(dev->sndlowat, globalfifo_capacity(dev)));
+}
+
+// copy bytes @pos up to @end of @from into @to at the same free running
+// offsets
+static void globalfifo_copy_range(struct globalfifo_buf *to, struct globalfifo_buf *from,
+                                  unsigned int pos, unsigned int end) {
+    while (pos != end) {
+        size_t chunk = end - pos;
+        void *addr = globalfifo_buf_addr(from, pos, &chunk);
+
+        globalfifo_poke(to, pos, addr, chunk);
+        pos += chunk;
+    }
+}
+
+// FIFO_SET_SIZE: copy what is queued into a new page list at the same free
+// running offsets, so head, tail and the broadcast cursors stay valid
+static long globalfifo_resize(struct globalfifo_dev *dev, unsigned long arg) {
+    struct globalfifo_buf buf;
+    unsigned int size, pos, head;
+    long ret;
+
+    if (!arg || arg > GLOBALFIFO_MAX_SIZE)
+        return -EINVAL;
+    size = roundup_pow_of_two(max_t(unsigned long, arg, PAGE_SIZE));
+    // allocate before taking the mutex, it may take a while at MB scale
+    ret = globalfifo_buf_alloc(&buf, size, dev->node);
+    if (ret)
+        return ret;
+
+    mutex_lock(&dev->mutex);
+    mutex_lock(&dev->map_lock);
+    // the shards have a size of their own. a mapping may still be looking
+    // at the old pages, a pipe keeps its own references to them
+    if (dev->mode == GLOBALFIFO_MODE_PERCPU) {
+        ret = -EINVAL;
+        goto out;
+    }
+    if (atomic_read(&dev->mmap_count)) {
+        ret = -EBUSY;
+        goto out;
+    }
+    // SPSC I/O runs without the mutex, keep it out while we swap
+    if (dev->mode == GLOBALFIFO_MODE_SPSC) {
+        if (test_and_set_bit_lock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy)) {
+            ret = -EBUSY;
+            goto out;
+        }
+        if (test_and_set_bit_lock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy)) {
+            clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+            ret = -EBUSY;
+            goto out;
+        }
+    }
+
+    // overwrite writers go on without the mutex, so copy without ow_lock
+    // until they only appended a little meanwhile, and that last bit and
+    // the swap under it. the bytes they overwrote were dropped from tail
+    // first, nobody needs them. in the other modes head is still
+    pos = READ_ONCE(dev->ring->tail);
+    head = READ_ONCE(dev->ring->head);
+    if (head - pos > size) {
+        ret = -EBUSY;
+        goto unbusy;
+    }
+    do {
+        globalfifo_copy_range(&buf, &dev->buf, pos, head);
+        pos = head;
+        head = READ_ONCE(dev->ring->head);
+    } while (head - pos > GLOBALFIFO_OW_CHUNK);
+    spin_lock(&dev->ow_lock);
+    if (dev->ring->head - dev->ring->tail > size) {
+        ret = -EBUSY;
+    } else {
+        globalfifo_copy_range(&buf, &dev->buf, pos, dev->ring->head);
+        swap(dev->buf.pages, buf.pages);
+        buf.size = dev->buf.size;
+        WRITE_ONCE(dev->buf.size, size);
+        dev->ring->size = size;
+        globalfifo_clamp_lowat(dev);
+        ret = size;
+    }
+    spin_unlock(&dev->ow_lock);
+
+unbusy:
+    if (dev->mode == GLOBALFIFO_MODE_SPSC) {
+        clear_bit_unlock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy);
+        clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+    }
+out:
+    mutex_unlock(&dev->map_lock);
+    mutex_unlock(&dev->mutex);
+    // the old pages on success, the unused new ones otherwise
+    globalfifo_buf_free(&buf);
+    if (ret > 0)
+        globalfifo_wake_writers_all(dev);
+    return ret;
+}
+
+// FIFO_SET_EVENTFD: attach the eventfd @fd, or detach with -1. the old
+// one may still be signalled until the grace period is over
+static long globalfifo_set_eventfd(struct globalfifo_dev *dev, int fd) {
+    struct eventfd_ctx *ctx = NULL;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    } else if (fd != -1) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&dev->mutex);
+    ctx = rcu_replace_pointer(dev->eventfd, ctx, lockdep_is_held(&dev->mutex));
+    mutex_unlock(&dev->mutex);
+    if (ctx) {
+        synchronize_rcu();
+        eventfd_ctx_put(ctx);
+    }
+    return 0;
+}
+
 static long globalfifo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    struct globalfifo_dev *dev = filp->private_data;
+    struct globalfifo_dev *dev = globalfifo_filp_dev(filp);
+    unsigned int cleared;
+    long ret = 0;
+    int old;
 
     switch (cmd) {
     case MEM_CLEAR:
         mutex_lock(&dev->mutex);
-        memset(dev->mem, 0, GLOBALFIFO_SIZE);
+        // in SPSC mode the reader side is ours for the duration, unless a
+        // reader works on the mapping where we can't see it. there are no
+        // mappings in the other modes, which can't change under the mutex
+        if (dev->mode == GLOBALFIFO_MODE_SPSC) {
+            mutex_lock(&dev->map_lock);
+            if (atomic_read(&dev->mmap_count) ||
+                test_and_set_bit_lock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy)) {
+                mutex_unlock(&dev->map_lock);
+                mutex_unlock(&dev->mutex);
+                return -EBUSY;
+            }
+        }
+        // drop the contents like a reader would, only the reader moves tail.
+        // zeroing the ring in place would leave zeros to be read as data
+        cleared = globalfifo_queued(dev);
+        if (dev->mode == GLOBALFIFO_MODE_PERCPU) {
+            globalfifo_pcpu_clear(dev);
+        } else {
+            spin_lock(&dev->ow_lock);
+            smp_store_release(&dev->ring->tail, READ_ONCE(dev->ring->head));
+            globalfifo_unstamp(dev, &dev->stamps, dev->ring->tail, false);
+            if (dev->mode == GLOBALFIFO_MODE_BROADCAST) {
+                struct globalfifo_file *gf;
+
+                list_for_each_entry(gf, &dev->readers, reader)
+                    gf->cursor = dev->ring->head;
+            }
+            spin_unlock(&dev->ow_lock);
+        }
+        if (dev->mode == GLOBALFIFO_MODE_SPSC) {
+            clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+            mutex_unlock(&dev->map_lock);
+        }
+        mutex_unlock(&dev->mutex);
+        globalfifo_wake_writers_all(dev);
+        trace_globalfifo_clear(dev->minor, cleared);
+        break;
+
+    case FIFO_SET_MODE:
+        if (arg != GLOBALFIFO_MODE_LOCKED && arg != GLOBALFIFO_MODE_SPSC &&
+            arg != GLOBALFIFO_MODE_PERCPU && arg != GLOBALFIFO_MODE_BROADCAST)
+            return -EINVAL;
+        // the lockless paths can't be switched under other users' feet,
+        // nor under another thread sharing our file that is inside one.
+        // the shards and the ring don't share data, so one of them must
+        // be empty to go between PERCPU and the others
+        mutex_lock(&dev->mutex);
+        mutex_lock(&dev->map_lock);
+        if (dev->nr_open != 1 || atomic_read(&dev->mmap_count)) {
+            ret = -EBUSY;
+        } else if (test_and_set_bit_lock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy)) {
+            ret = -EBUSY;
+        } else if (test_and_set_bit_lock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy)) {
+            clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+            ret = -EBUSY;
+        }
+        if (ret) {
+            mutex_unlock(&dev->map_lock);
+            mutex_unlock(&dev->mutex);
+            break;
+        }
+        if ((arg == GLOBALFIFO_MODE_PERCPU) != (dev->mode == GLOBALFIFO_MODE_PERCPU) &&
+            (globalfifo_len(dev) || atomic_read(&dev->pcpu_len)))
+            ret = -EBUSY;
+        else if (arg == GLOBALFIFO_MODE_SPSC && (dev->flags & GLOBALFIFO_F_OVERWRITE))
+            ret = -EINVAL;
+        else if ((arg == GLOBALFIFO_MODE_SPSC || arg == GLOBALFIFO_MODE_BROADCAST) &&
+                 (dev->flags & GLOBALFIFO_F_TIMESTAMP))
+            ret = -EINVAL;
+        else if (arg == GLOBALFIFO_MODE_PERCPU)
+            ret = globalfifo_pcpu_alloc(dev);
+        // an SPSC writer or a mapping writes without looking at page
+        // references, take back whatever splice_read lent out first
+        else if (arg == GLOBALFIFO_MODE_SPSC && dev->mode != arg)
+            ret = globalfifo_unshare(&dev->buf, 0, dev->buf.size, dev->node, GFP_KERNEL);
+        // overwrite writers look at the mode under ow_lock only, and may
+        // have queued on the ring since it was found empty
+        spin_lock(&dev->ow_lock);
+        if (!ret && arg == GLOBALFIFO_MODE_PERCPU && dev->mode != arg && globalfifo_len(dev))
+            ret = -EBUSY;
+        if (!ret && arg == GLOBALFIFO_MODE_BROADCAST && dev->mode != arg) {
+            struct globalfifo_file *gf;
+
+            // the queued data is there for the reader we have, if any
+            list_for_each_entry(gf, &dev->readers, reader) {
+                gf->cursor = dev->ring->tail;
+                gf->lagged = false;
+            }
+        }
+        old = dev->mode;
+        if (!ret) {
+            WRITE_ONCE(dev->mode, arg);
+            set_bit(GLOBALFIFO_MODE_SWITCH, &dev->spsc_busy);
+        }
+        spin_unlock(&dev->ow_lock);
+        mutex_unlock(&dev->map_lock);
+        // a shard writer that took its lock before the switch may still
+        // queue there, wait for them and go back if one did. they copy
+        // from user space under that lock, so this can't be under map_lock
+        if (!ret && old == GLOBALFIFO_MODE_PERCPU && arg != old && !globalfifo_pcpu_quiesce(dev)) {
+            spin_lock(&dev->ow_lock);
+            WRITE_ONCE(dev->mode, old);
+            spin_unlock(&dev->ow_lock);
+            ret = -EBUSY;
+        }
+        if (!ret)
+            globalfifo_clamp_lowat(dev);
+        clear_bit_unlock(GLOBALFIFO_MODE_SWITCH, &dev->spsc_busy);
+        clear_bit_unlock(GLOBALFIFO_SPSC_WRITER, &dev->spsc_busy);
+        clear_bit_unlock(GLOBALFIFO_SPSC_READER, &dev->spsc_busy);
+        mutex_unlock(&dev->mutex);
+        // sleepers of the old mode start over in the new one
+        if (!ret) {
+            wake_up_interruptible_all(&dev->r_wait);
+            globalfifo_wake_writers_all(dev);
+        }
+        break;
+
+    case FIFO_SET_FLAGS:
+        if (arg & ~GLOBALFIFO_F_ALL)
+            return -EINVAL;
+        if ((arg & GLOBALFIFO_F_PACKET_BATCH) && !(arg & GLOBALFIFO_F_PACKET))
+            return -EINVAL;
+        // the framing of queued data can't change under it
+        mutex_lock(&dev->mutex);
+        if (dev->nr_open != 1 || globalfifo_len(dev) || atomic_read(&dev->pcpu_len))
+            ret = -EBUSY;
+        else if ((arg & GLOBALFIFO_F_OVERWRITE) && dev->mode == GLOBALFIFO_MODE_SPSC)
+            ret = -EINVAL;
+        else if ((arg & GLOBALFIFO_F_TIMESTAMP) &&
+                 (dev->mode == GLOBALFIFO_MODE_SPSC || dev->mode == GLOBALFIFO_MODE_BROADCAST))
+            ret = -EINVAL;
+        // overwrite writers can't allocate under their spinlock to copy
+        // a page splice_read lent out, take them all back now
+        else if ((arg & GLOBALFIFO_F_OVERWRITE) && !(dev->flags & GLOBALFIFO_F_OVERWRITE))
+            ret = globalfifo_unshare(&dev->buf, 0, dev->buf.size, dev->node, GFP_KERNEL);
+        if (!ret) {
+            // the ring's writers decide on overwrite under ow_lock,
+            // everybody else under the mutex
+            spin_lock(&dev->ow_lock);
+            WRITE_ONCE(dev->flags, arg);
+            spin_unlock(&dev->ow_lock);
+        }
+        mutex_unlock(&dev->mutex);
+        break;
+
+    case FIFO_SET_LOWAT: {
+        struct globalfifo_lowat lowat;
+
+        if (copy_from_user(&lowat, (void __user *)arg, sizeof(lowat)))
+            return -EFAULT;
+        if (!lowat.rcvlowat || !lowat.sndlowat)
+            return -EINVAL;
+        mutex_lock(&dev->mutex);
+        if (lowat.rcvlowat > globalfifo_capacity(dev) || lowat.sndlowat > globalfifo_capacity(dev)) {
+            mutex_unlock(&dev->mutex);
+            return -EINVAL;
+        }
+        WRITE_ONCE(dev->rcvlowat, lowat.rcvlowat);
+        WRITE_ONCE(dev->sndlowat, lowat.sndlowat);
         mutex_unlock(&dev->mutex);
-        printk(KERN_INFO "globalfifo is set to zero\n");
+        // lowered marks may already be met
+        wake_up_interruptible_all(&dev->r_wait);
+        globalfifo_notify(dev, POLL_IN);
+        globalfifo_wake_writers_all(dev);
+        break;
+    }
+
+    case FIFO_GET_DROPS: {
+        struct globalfifo_drops drops = {
+            .bytes = atomic64_read(&dev->dropped_bytes),
+            .records = atomic64_read(&dev->dropped_records),
+        };
+
+        if (copy_to_user((void __user *)arg, &drops, sizeof(drops)))
+            return -EFAULT;
+        break;
+    }
+
+    case FIFO_SET_SIZE:
+        return globalfifo_resize(dev, arg);
+
+    case FIFO_GET_SIZE:
+        return READ_ONCE(dev->mode) == GLOBALFIFO_MODE_PERCPU ? GLOBALFIFO_SIZE : READ_ONCE(dev->buf.size);
+
+    case FIFO_RING_KICK:
+        // a peer moved head/tail through the mapping and saw a waiting flag
+        globalfifo_ring_wake(dev, GLOBALFIFO_RING_READER_WAITING, &dev->r_wait);
+        globalfifo_ring_wake(dev, GLOBALFIFO_RING_WRITER_WAITING, &dev->w_wait);
+        globalfifo_notify(dev, POLL_IN);
+        globalfifo_notify(dev, POLL_OUT);
         break;
 
+    case FIFO_SET_EVENTFD:
+        return globalfifo_set_eventfd(dev, (int)arg);
+
     default:
         return -EINVAL;
     }
 
-    return 0;
+    return ret;
 }
 
 static unsigned int globalfifo_poll(struct file *filp, poll_table * wait)
 {
     unsigned int mask = 0;
-    struct globalfifo_dev *dev = filp->private_data;
-
-    mutex_lock(&dev->mutex);;
+    struct globalfifo_dev *dev = globalfifo_filp_dev(filp);
+    __poll_t events = poll_requested_events(wait);
+    unsigned int rcv = globalfifo_rcv_want(dev);
+    unsigned int snd = globalfifo_snd_want(dev, 1);
+    unsigned int len;
+    int mode = READ_ONCE(dev->mode);
+    bool spsc = mode == GLOBALFIFO_MODE_SPSC;
 
+    // readiness comes from head/tail or the shard total without dev->mutex.
+    // every waker changes them before wake_up(), which takes the queue lock
+    // poll_wait() took, so we either see the change or get woken
     poll_wait(filp, &dev->r_wait, wait);
     poll_wait(filp, &dev->w_wait, wait);
 
-    if (dev->current_len != 0) {
+    // PERCPU: data in any shard is readable, a write goes to our own shard
+    if (mode == GLOBALFIFO_MODE_PERCPU) {
+        struct globalfifo_shard *shard = globalfifo_pcpu_home(filp);
+
+        poll_wait(filp, &shard->w_wait, wait);
+        if (atomic_read(&dev->pcpu_len) >= rcv)
+            mask |= POLLIN | POLLRDNORM;
+        if (globalfifo_shard_free(shard) >= snd || (READ_ONCE(dev->flags) & GLOBALFIFO_F_OVERWRITE))
+            mask |= POLLOUT | POLLWRNORM;
+        return mask;
+    }
+
+    // BROADCAST: readable from our own cursor, POLLERR once we've been cut off
+    if (mode == GLOBALFIFO_MODE_BROADCAST) {
+        struct globalfifo_file *gf = filp->private_data;
+
+        if (READ_ONCE(gf->lagged))
+            mask |= POLLERR;
+        if (READ_ONCE(dev->ring->head) - READ_ONCE(gf->cursor) >= rcv)
+            mask |= POLLIN | POLLRDNORM;
+        if (globalfifo_room(dev) >= snd || (READ_ONCE(dev->flags) & GLOBALFIFO_F_OVERWRITE))
+            mask |= POLLOUT | POLLWRNORM;
+        return mask;
+    }
+
+    len = globalfifo_len(dev);
+    // about to sleep: ask peers on the mapping to kick us, then recheck
+    if (spsc && len < rcv && (events & POLLIN) &&
+        globalfifo_ring_readable(dev->ring, READ_ONCE(dev->ring->tail), rcv))
+        len = globalfifo_len(dev);
+    if (spsc && READ_ONCE(dev->buf.size) - len < snd && (events & POLLOUT) &&
+        globalfifo_ring_writable(dev, READ_ONCE(dev->ring->head), snd))
+        len = globalfifo_len(dev);
+
+    // the same marks the blocking paths wake on. writes are atomic records
+    // in packet mode, so any data is a whole record
+    if (len >= rcv) {
         mask |= POLLIN | POLLRDNORM;
     }
 
-    if (dev->current_len != GLOBALFIFO_SIZE) {
+    // room for sndlowat bytes, and at least a one byte write or record
+    if ((spsc ? READ_ONCE(dev->buf.size) - len : globalfifo_room(dev)) >= snd ||
+        (READ_ONCE(dev->flags) & GLOBALFIFO_F_OVERWRITE)) {
         mask |= POLLOUT | POLLWRNORM;
     }
 
-    mutex_unlock(&dev->mutex);;
     return mask;
 }
 
 
+static void globalfifo_vm_open(struct vm_area_struct *vma) {
+    struct globalfifo_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mmap_count);
+}
+
+static void globalfifo_vm_close(struct vm_area_struct *vma) {
+    struct globalfifo_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mmap_count);
+}
+
+static const struct vm_operations_struct globalfifo_vm_ops = {
+    .open = globalfifo_vm_open,
+    .close = globalfifo_vm_close,
+};
+
+// insert the header page and the data pages the vma covers, the way
+// remap_vmalloc_range() would. FIFO_SET_SIZE is refused while mapped, so
+// they stay the FIFO's pages for as long as the mapping lives
+static int globalfifo_map_pages(struct globalfifo_dev *dev, struct vm_area_struct *vma) {
+    unsigned long nr = (PAGE_SIZE + dev->buf.size) >> PAGE_SHIFT;
+    unsigned long addr, idx = vma->vm_pgoff;
+    int ret;
+
+    if (idx >= nr || vma_pages(vma) > nr - idx)
+        return -EINVAL;
+    for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE, ++idx) {
+        struct page *page = idx ? dev->buf.pages[idx - 1] : virt_to_page(dev->ring);
+
+        ret = vm_insert_page(vma, addr, page);
+        if (ret)
+            return ret;
+    }
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    return 0;
+}
+
+// map the ring header page and the data pages behind it, so an SPSC
+// producer and consumer can exchange data without any syscall. not under
+// dev->mutex, see map_lock
+static int globalfifo_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct globalfifo_dev *dev = globalfifo_filp_dev(filp);
+    int ret;
+
+    mutex_lock(&dev->map_lock);
+    if (dev->mode != GLOBALFIFO_MODE_SPSC) {
+        ret = -EINVAL;
+        goto out;
+    }
+    // FIFO_SET_MODE may still go back on the switch
+    if (test_bit(GLOBALFIFO_MODE_SWITCH, &dev->spsc_busy)) {
+        ret = -EBUSY;
+        goto out;
+    }
+    ret = globalfifo_map_pages(dev, vma);
+    if (ret)
+        goto out;
+    vma->vm_ops = &globalfifo_vm_ops;
+    vma->vm_private_data = dev;
+    globalfifo_vm_open(vma);
+out:
+    mutex_unlock(&dev->map_lock);
+    return ret;
+}
+
 static const struct file_operations globalfifo_fops = {
     .owner = THIS_MODULE,
     .llseek = globalfifo_llseek,
-    .read = globalfifo_read,
-    .write = globalfifo_write,
+    .read_iter = globalfifo_read_iter,
+    .write_iter = globalfifo_write_iter,
     .unlocked_ioctl = globalfifo_ioctl,
+    .mmap = globalfifo_mmap,
     .open = globalfifo_open,
     .release = globalfifo_release,
     .poll = globalfifo_poll,
+    .splice_read = globalfifo_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fasync = globalfifo_fasync,
 };
 
-static void globalfifo_setup_cdev(struct globalfifo_dev* dev, int index) {
-    int err, devno = MKDEV(globalfifo_major, index);
+static int globalfifo_latency_show(struct seq_file *m, void *v) {
+    struct globalfifo_dev *dev = m->private;
+    int i;
+
+    for (i = 0; i < GLOBALFIFO_LAT_BUCKETS; ++i) {
+        s64 n = atomic64_read(&dev->lat_hist[i]);
+
+        if (n)
+            seq_printf(m, "%20llu ns: %lld\n", 1ULL << i, n);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalfifo_latency);
+
+static int globalfifo_stats_show(struct seq_file *m, void *v) {
+    struct globalfifo_dev *dev = m->private;
+    struct globalfifo_stats sum = {};
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct globalfifo_stats *stats = per_cpu_ptr(dev->stats, cpu);
+
+        sum.reads += stats->reads;
+        sum.read_bytes += stats->read_bytes;
+        sum.writes += stats->writes;
+        sum.write_bytes += stats->write_bytes;
+        sum.waits += stats->waits;
+        sum.eagain += stats->eagain;
+    }
+    seq_printf(m, "reads: %llu\nread_bytes: %llu\nwrites: %llu\nwrite_bytes: %llu\n"
+               "waits: %llu\neagain: %llu\n", sum.reads, sum.read_bytes, sum.writes,
+               sum.write_bytes, sum.waits, sum.eagain);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalfifo_stats);
+
+// <debugfs>/globalfifo/globalfifoN/
+static void globalfifo_debugfs_init(struct globalfifo_dev *dev, int index) {
+    char name[32];
+    struct dentry *dir;
+
+    snprintf(name, sizeof(name), "globalfifo%d", index);
+    dir = debugfs_create_dir(name, globalfifo_debugfs);
+    debugfs_create_file("latency", 0444, dir, dev, &globalfifo_latency_fops);
+    debugfs_create_file("stats", 0444, dir, dev, &globalfifo_stats_fops);
+}
+
+static int globalfifo_setup_cdev(void) {
+    int err;
 
     // init cdev, connect file_operation to cdev
-    cdev_init(&dev->cdev, &globalfifo_fops);
-    dev->cdev.owner = THIS_MODULE;
-    // rigister a cdev to system
-    err = cdev_add(&dev->cdev, devno, 1);
+    cdev_init(&globalfifo_cdev, &globalfifo_fops);
+    globalfifo_cdev.owner = THIS_MODULE;
+    // one cdev for all the minors, the FIFOs come with their first open
+    err = cdev_add(&globalfifo_cdev, MKDEV(globalfifo_major, 0), globalfifo_nr_devs);
     if (err) {
-        printk(KERN_NOTICE "Error %d adding globalfifo%d", err, index);
+        printk(KERN_NOTICE "Error %d adding globalfifo", err);
+    }
+    return err;
+}
+
+// the NUMA node for @minor's memory, see globalfifo_node. called by its first
+// opener
+static int globalfifo_dev_node(unsigned int minor) {
+    int node = NUMA_NO_NODE;
+
+    if (globalfifo_nr_node)
+        node = globalfifo_node[min_t(unsigned int, minor, globalfifo_nr_node - 1)];
+    // a node may have gone offline since the module was loaded
+    if (node == NUMA_NO_NODE || !node_online(node))
+        node = numa_node_id();
+    return node;
+}
+
+static int globalfifo_init_dev(struct globalfifo_dev *dev, int minor, int node) {
+    struct page *page;
+    int ret;
+
+    dev->minor = minor;
+    dev->node = node;
+    // header page, then the data pages
+    page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+    if (!page)
+        return -ENOMEM;
+    dev->ring = page_address(page);
+    ret = globalfifo_buf_alloc(&dev->buf, globalfifo_size, node);
+    if (ret)
+        goto fail_buf;
+    dev->ring->size = globalfifo_size;
+    dev->stats = alloc_percpu(struct globalfifo_stats);
+    if (!dev->stats) {
+        ret = -ENOMEM;
+        goto fail_stats;
+    }
+
+    mutex_init(&dev->mutex);
+    mutex_init(&dev->map_lock);
+    spin_lock_init(&dev->ow_lock);
+    INIT_LIST_HEAD(&dev->readers);
+    dev->rcvlowat = 1;
+    dev->sndlowat = 1;
+    init_waitqueue_head(&dev->r_wait);
+    init_waitqueue_head(&dev->w_wait);
+    return 0;
+
+fail_stats:
+    globalfifo_buf_free(&dev->buf);
+fail_buf:
+    free_page((unsigned long)dev->ring);
+    return ret;
+}
+
+static void globalfifo_free_dev(struct globalfifo_dev *dev) {
+    globalfifo_buf_free(&dev->buf);
+    free_page((unsigned long)dev->ring);
+    if (rcu_access_pointer(dev->eventfd))
+        eventfd_ctx_put(rcu_access_pointer(dev->eventfd));
+    globalfifo_pcpu_free(dev->shards);
+    free_percpu(dev->stats);
+    kmem_cache_free(globalfifo_cachep, dev);
+}
+
+// the FIFO behind @minor, allocated on its first open. until then a
+// minor costs one pointer
+static struct globalfifo_dev *globalfifo_get_dev(unsigned int minor) {
+    struct globalfifo_dev *dev;
+    int node, ret;
+
+    // pairs with the release below, a FIFO seen here is set up
+    dev = smp_load_acquire(&globalfifo_devs[minor]);
+    if (dev)
+        return dev;
+
+    mutex_lock(&globalfifo_devs_lock);
+    dev = globalfifo_devs[minor];
+    if (dev)
+        goto out;
+    node = globalfifo_dev_node(minor);
+    dev = kmem_cache_alloc_node(globalfifo_cachep, GFP_KERNEL | __GFP_ZERO, node);
+    if (!dev) {
+        dev = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+    ret = globalfifo_init_dev(dev, minor, node);
+    if (ret) {
+        kmem_cache_free(globalfifo_cachep, dev);
+        dev = ERR_PTR(ret);
+        goto out;
     }
+    globalfifo_debugfs_init(dev, minor);
+    smp_store_release(&globalfifo_devs[minor], dev);
+out:
+    mutex_unlock(&globalfifo_devs_lock);
+    return dev;
 }
 
 static int __init globalfifo_init(void) {
     int ret = 0;
-    int i = 0;
+    int i;
     dev_t devno = MKDEV(globalfifo_major, 0);
 
+    if (!globalfifo_size || globalfifo_size > GLOBALFIFO_MAX_SIZE)
+        return -EINVAL;
+    globalfifo_size = roundup_pow_of_two(max_t(unsigned int, globalfifo_size, PAGE_SIZE));
+    if (!globalfifo_nr_devs || globalfifo_nr_devs > MINORMASK + 1)
+        return -EINVAL;
+    for (i = 0; i < globalfifo_nr_node; ++i) {
+        if (globalfifo_node[i] != NUMA_NO_NODE &&
+            (globalfifo_node[i] < 0 || globalfifo_node[i] >= MAX_NUMNODES || !node_online(globalfifo_node[i])))
+            return -EINVAL;
+    }
+
     // request a devno
     if (globalfifo_major) {
-        ret = register_chrdev_region(devno, DEVICE_NUM, "globalfifo");
+        ret = register_chrdev_region(devno, globalfifo_nr_devs, "globalfifo");
     } else {
-        ret = alloc_chrdev_region(&devno, 0, DEVICE_NUM, "globalfifo");
+        ret = alloc_chrdev_region(&devno, 0, globalfifo_nr_devs, "globalfifo");
         globalfifo_major = MAJOR(devno);
     }
 
     if (ret < 0) return ret;
 
-    globalfifo_devp = kzalloc(sizeof(struct globalfifo_dev) * DEVICE_NUM, GFP_KERNEL);
-    if (!globalfifo_devp) {
+    globalfifo_devs = kvcalloc(globalfifo_nr_devs, sizeof(*globalfifo_devs), GFP_KERNEL);
+    if (!globalfifo_devs) {
         ret = -ENOMEM;
         goto fail_malloc;
     }
-
-    // init mutex
-    mutex_init(&globalfifo_devp->mutex);
-    for (i = 0; i < DEVICE_NUM; ++i) {
-        globalfifo_setup_cdev(globalfifo_devp + i, i);
-        init_waitqueue_head(&((globalfifo_devp+i)->r_wait));
-        init_waitqueue_head(&((globalfifo_devp+i)->w_wait));
+    globalfifo_cachep = KMEM_CACHE(globalfifo_dev, SLAB_HWCACHE_ALIGN);
+    if (!globalfifo_cachep) {
+        ret = -ENOMEM;
+        goto fail_cache;
     }
+
+    globalfifo_debugfs = debugfs_create_dir("globalfifo", NULL);
+    ret = globalfifo_setup_cdev();
+    if (ret)
+        goto fail_cdev;
     
     return 0;
 
+fail_cdev:
+    debugfs_remove_recursive(globalfifo_debugfs);
+    kmem_cache_destroy(globalfifo_cachep);
+fail_cache:
+    kvfree(globalfifo_devs);
 fail_malloc:
-    unregister_chrdev_region(devno, DEVICE_NUM);
+    unregister_chrdev_region(devno, globalfifo_nr_devs);
     return ret;
 }
 
 static void __exit globalfifo_exit(void) {
-    int i = 0; 
-    for (; i < DEVICE_NUM; ++i)
-        cdev_del(&(globalfifo_devp + i)->cdev);  // unrigister cdev obj
-    kfree(globalfifo_devp);
+    unsigned int i = 0; 
+    cdev_del(&globalfifo_cdev);  // unrigister cdev obj
+    debugfs_remove_recursive(globalfifo_debugfs);
+    for (; i < globalfifo_nr_devs; ++i) {
+        if (globalfifo_devs[i])
+            globalfifo_free_dev(globalfifo_devs[i]);
+    }
+    kvfree(globalfifo_devs);
+    kmem_cache_destroy(globalfifo_cachep);
     // release dev number
-    unregister_chrdev_region(MKDEV(globalfifo_major, 0), DEVICE_NUM);
+    unregister_chrdev_region(MKDEV(globalfifo_major, 0), globalfifo_nr_devs);
 }
 
 module_init(globalfifo_init);
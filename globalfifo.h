@@ -1,28 +1,229 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/eventfd.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
-#define GLOBALFIFO_SIZE 0x1000
+#define GLOBALFIFO_SIZE 0x1000              // default capacity, and of each PERCPU shard
+#define GLOBALFIFO_MAX_SIZE (64 << 20)      // FIFO_SET_SIZE/globalfifo_size limit
 // #define MEM_CLEAR 0x1
 #define GLOBALFIFO_MAJOR 230
-#define DEVICE_NUM      3
+#define GLOBALFIFO_MAX_NODES 64             // entries of globalfifo_node
+#define DEVICE_NUM      3                   // default of globalfifo_nr_devs
 
 #define GLOBALFIFO_MAGIC 'g'
 #define MEM_CLEAR _IO(GLOBALFIFO_MAGIC,0)
+#define FIFO_SET_MODE _IOW(GLOBALFIFO_MAGIC, 1, int)  // enum globalfifo_mode
+#define FIFO_RING_KICK _IO(GLOBALFIFO_MAGIC, 2)       // wake sleepers of a mmap'ed ring
+#define FIFO_SET_FLAGS _IOW(GLOBALFIFO_MAGIC, 3, int) // GLOBALFIFO_F_*
+#define FIFO_SET_LOWAT _IOW(GLOBALFIFO_MAGIC, 4, struct globalfifo_lowat)
+#define FIFO_GET_DROPS _IOR(GLOBALFIFO_MAGIC, 5, struct globalfifo_drops)
+// like F_SETPIPE_SZ/F_GETPIPE_SZ: the size is passed by value, rounded up
+// to a power of two pages and returned. queued data is kept, so it fails
+// with -EBUSY if that doesn't fit
+#define FIFO_SET_SIZE _IOW(GLOBALFIFO_MAGIC, 6, int)
+#define FIFO_GET_SIZE _IO(GLOBALFIFO_MAGIC, 7)
+// eventfd by value, -1 detaches. it is signalled whenever the device turns
+// readable or writable, for event loops built around eventfds
+#define FIFO_SET_EVENTFD _IOW(GLOBALFIFO_MAGIC, 8, int)
+
+// wakeup watermarks, like SO_RCVLOWAT/SO_SNDLOWAT. blocked readers and
+// POLLIN wait for rcvlowat queued bytes, writers and POLLOUT for sndlowat
+// free bytes. both default to 1
+struct globalfifo_lowat {
+    __u32 rcvlowat;
+    __u32 sndlowat;
+};
+
+// a ring of @size bytes, a power of two, in order-0 pages so no size needs
+// a high-order or vmalloc allocation
+struct globalfifo_buf {
+    struct page **pages;
+    unsigned int size;
+};
+
+// write stamps, kept beside the data so the ring format doesn't change.
+// when all are taken, a write is folded into the newest stamp and counts
+// as queued since then
+#define GLOBALFIFO_NR_STAMPS 128
+#define GLOBALFIFO_LAT_BUCKETS 64   // [2^i, 2^(i+1)) ns
+
+struct globalfifo_stamps {
+    unsigned int head;
+    unsigned int tail;
+    struct {
+        unsigned int end;  // ring position just past the write
+        u64 ns;
+    } ent[GLOBALFIFO_NR_STAMPS];
+};
+
+// per-CPU, summed up by <debugfs>/globalfifo/globalfifoN/stats. calls that
+// moved data count as ops, waits are sleeps for data or room
+struct globalfifo_stats {
+    u64 reads;
+    u64 read_bytes;
+    u64 writes;
+    u64 write_bytes;
+    u64 waits;
+    u64 eagain;
+};
+
+enum globalfifo_mode {
+    GLOBALFIFO_MODE_LOCKED = 0,  // any number of readers/writers, dev->mutex
+    GLOBALFIFO_MODE_SPSC,        // one reader and one writer, no mutex, mmap-able
+    GLOBALFIFO_MODE_PERCPU,      // many readers/writers, one sub-ring per CPU
+    GLOBALFIFO_MODE_BROADCAST,   // every reader sees every byte, dev->mutex
+};
+
+// PERCPU mode: a file appends to the shard of the CPU it first wrote on,
+// so one producer's data stays in order. readers drain the shard of their
+// CPU first and steal from the others when it is empty
+struct globalfifo_shard {
+    struct mutex lock;    // the shard's producers, bar overwrite ones, and whoever drains it
+    spinlock_t ow_lock;   // see globalfifo_dev
+    unsigned int head;    // free running like ring->head/tail
+    unsigned int tail;
+    struct globalfifo_buf buf;  // GLOBALFIFO_SIZE bytes on the CPU's node
+    struct globalfifo_stamps stamps;
+    wait_queue_head_t w_wait;  // its writers, so a read wakes one that fits
+};
+
+// packet mode: each write is queued as one record behind this header and
+// each read returns exactly one record, truncated to the read size like a
+// O_DIRECT pipe. with PACKET_BATCH a read returns as many whole records as
+// fit instead, each still behind its header
+#define GLOBALFIFO_F_PACKET       0x1
+#define GLOBALFIFO_F_PACKET_BATCH 0x2
+// flight recorder: a write never waits, the oldest data (whole records in
+// packet mode) is dropped to make room. not in SPSC mode, where only the
+// reader may move tail. reads go through a kernel buffer, in chunks of
+// GLOBALFIFO_OW_CHUNK for a byte stream, so a reader never holds up a
+// writer for longer than a memcpy
+#define GLOBALFIFO_F_OVERWRITE    0x4
+#define GLOBALFIFO_OW_CHUNK       PAGE_SIZE
+// stamp every write with ktime_get_ns() and, once a reader has consumed
+// all of it, add the time it sat queued to the device's log2 latency
+// histogram in debugfs. LOCKED and PERCPU mode only
+#define GLOBALFIFO_F_TIMESTAMP    0x8
+#define GLOBALFIFO_F_ALL (GLOBALFIFO_F_PACKET | GLOBALFIFO_F_PACKET_BATCH | GLOBALFIFO_F_OVERWRITE | \
+                          GLOBALFIFO_F_TIMESTAMP)
+
+// FIFO_GET_DROPS, running totals since the module was loaded. a consumer
+// that sees them move between two reads knows it missed data in between
+struct globalfifo_drops {
+    __u64 bytes;    // headers included in packet mode
+    __u64 records;  // packet mode only
+};
+
+struct globalfifo_pkt_hdr {
+    __u32 len;  // payload bytes following the header
+};
+
+// ring->flags, set by a sleeping side. a peer that moved head/tail through
+// the mapping checks them after a full barrier and issues FIFO_RING_KICK
+#define GLOBALFIFO_RING_READER_WAITING 0x1
+#define GLOBALFIFO_RING_WRITER_WAITING 0x2
+
+// page 0 of the mmap'ed area, the data pages follow from PAGE_SIZE on.
+// head and tail sit on their own cache lines
+struct globalfifo_ring {
+    __u32 head;      // free running, only the writer moves it
+    __u32 pad0[15];
+    __u32 tail;      // free running, only the reader moves it
+    __u32 pad1[15];
+    atomic_t flags;  // GLOBALFIFO_RING_*_WAITING
+    __u32 size;      // data bytes, power of two
+};
+
+// spsc_busy bits, catch a second reader or writer in SPSC mode
+#define GLOBALFIFO_SPSC_READER 0
+#define GLOBALFIFO_SPSC_WRITER 1
+// and the mode FIFO_SET_MODE just set, until it can't go back on it
+#define GLOBALFIFO_MODE_SWITCH 2
 
 static int globalfifo_major = GLOBALFIFO_MAJOR;
 module_param(globalfifo_major, int, S_IRUGO);
+// initial capacity of each FIFO, FIFO_SET_SIZE changes it later
+static unsigned int globalfifo_size = GLOBALFIFO_SIZE;
+module_param(globalfifo_size, uint, S_IRUGO);
+// minors to register, a FIFO only takes memory once opened
+static unsigned int globalfifo_nr_devs = DEVICE_NUM;
+module_param(globalfifo_nr_devs, uint, S_IRUGO);
+// NUMA node of each minor's memory, in minor order. minors past the end
+// take the last entry, -1 (the default) puts a FIFO on the node of the
+// process that first opens it
+static int globalfifo_node[GLOBALFIFO_MAX_NODES];
+static int globalfifo_nr_node;
+module_param_array(globalfifo_node, int, &globalfifo_nr_node, S_IRUGO);
 
+// from globalfifo_cachep, cacheline aligned so FIFOs never share a line
 struct globalfifo_dev {
-    struct cdev cdev;
-    unsigned int current_len;
-    unsigned char mem[GLOBALFIFO_SIZE];
+    int minor;
+    int node;  // NUMA node its memory comes from
+    // head/tail index buf modulo its size, head - tail is the current
+    // length. both live in the ring page so they can be mmap'ed
+    struct globalfifo_ring *ring;
+    struct globalfifo_buf buf;  // the data, changed under dev->mutex
+    int mode;                 // enum globalfifo_mode
+    unsigned int flags;       // GLOBALFIFO_F_*
+    unsigned int rcvlowat;
+    unsigned int sndlowat;
+    atomic_t mmap_count;
+    unsigned long spsc_busy;
+    unsigned int nr_open;
     struct mutex mutex;
+    // mmap() runs under mmap_lock, which a fault in a copy to or from user
+    // space takes under dev->mutex. so it takes this instead, never held
+    // across a user copy, and whatever checks mmap_count and then changes
+    // the mode or the pages holds it too, inside dev->mutex
+    struct mutex map_lock;
+    // GLOBALFIFO_F_OVERWRITE writers take only this, never dev->mutex, to
+    // move head and tail, so readers take it too but don't hold it across
+    // a copy to user space. the broadcast cursors change under it as well
+    spinlock_t ow_lock;
     wait_queue_head_t r_wait;
     wait_queue_head_t w_wait;
+    struct globalfifo_shard __percpu *shards;  // PERCPU mode, allocated on first use
+    atomic_t pcpu_len;        // bytes queued over all shards
+    struct list_head readers; // struct globalfifo_file opened for reading
+    atomic64_t dropped_bytes;   // GLOBALFIFO_F_OVERWRITE
+    atomic64_t dropped_records;
+    struct globalfifo_stamps stamps;    // GLOBALFIFO_F_TIMESTAMP, ring modes
+    atomic64_t lat_hist[GLOBALFIFO_LAT_BUCKETS];
+    struct globalfifo_stats __percpu *stats;
+    struct fasync_struct *async_queue;  // SIGIO
+    struct eventfd_ctx __rcu *eventfd;  // FIFO_SET_EVENTFD
+} ____cacheline_aligned_in_smp;
+
+// per open file
+struct globalfifo_file {
+    struct globalfifo_dev *dev;
+    int shard;                // CPU whose shard we write to, -1 until the first write
+    // BROADCAST mode, readable files only. tail is the slowest cursor, so
+    // writers wait for it, or with GLOBALFIFO_F_OVERWRITE move it on and
+    // cut off whoever is left behind. their next read fails with -EPIPE
+    // once and goes on from the oldest data still there
+    struct list_head reader;  // dev->readers
+    unsigned int cursor;      // free running like ring->tail
+    bool lagged;
 };
 
-struct globalfifo_dev* globalfifo_devp;
+// one cdev covers every minor, globalfifo_devs[minor] is set up on open
+static struct cdev globalfifo_cdev;
+static struct globalfifo_dev **globalfifo_devs;
+static DEFINE_MUTEX(globalfifo_devs_lock);
+static struct kmem_cache *globalfifo_cachep;
+static struct dentry *globalfifo_debugfs;
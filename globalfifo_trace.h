@@ -0,0 +1,92 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM globalfifo
+
+#if !defined(_GLOBALFIFO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GLOBALFIFO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// @ret is what the call returns, @len what is left queued after it
+DECLARE_EVENT_CLASS(globalfifo_io,
+    TP_PROTO(int minor, ssize_t ret, unsigned int len),
+    TP_ARGS(minor, ret, len),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(ssize_t, ret)
+        __field(unsigned int, len)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+        __entry->len = len;
+    ),
+
+    TP_printk("globalfifo%d ret=%zd len=%u", __entry->minor, __entry->ret, __entry->len)
+);
+
+DEFINE_EVENT(globalfifo_io, globalfifo_read,
+    TP_PROTO(int minor, ssize_t ret, unsigned int len),
+    TP_ARGS(minor, ret, len)
+);
+
+DEFINE_EVENT(globalfifo_io, globalfifo_write,
+    TP_PROTO(int minor, ssize_t ret, unsigned int len),
+    TP_ARGS(minor, ret, len)
+);
+
+// MEM_CLEAR, @len bytes thrown away
+TRACE_EVENT(globalfifo_clear,
+    TP_PROTO(int minor, unsigned int len),
+    TP_ARGS(minor, len),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, len)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->len = len;
+    ),
+
+    TP_printk("globalfifo%d len=%u", __entry->minor, __entry->len)
+);
+
+// a reader or writer blocking for data or room, and getting going again
+DECLARE_EVENT_CLASS(globalfifo_wait,
+    TP_PROTO(int minor, bool writer),
+    TP_ARGS(minor, writer),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(bool, writer)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->writer = writer;
+    ),
+
+    TP_printk("globalfifo%d %s", __entry->minor, __entry->writer ? "writer" : "reader")
+);
+
+DEFINE_EVENT(globalfifo_wait, globalfifo_sleep,
+    TP_PROTO(int minor, bool writer),
+    TP_ARGS(minor, writer)
+);
+
+DEFINE_EVENT(globalfifo_wait, globalfifo_wakeup,
+    TP_PROTO(int minor, bool writer),
+    TP_ARGS(minor, writer)
+);
+
+#endif /* _GLOBALFIFO_TRACE_H */
+
+// out of tree, the Makefile puts the module directory on the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE globalfifo_trace
+#include <trace/define_trace.h>
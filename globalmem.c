@@ -1,8 +1,18 @@
 #include "globalmem.h"
 
+#define CREATE_TRACE_POINTS
+#include "globalmem_trace.h"
+
+static struct globalmem_dev *globalmem_get_dev(unsigned int minor);
+
 static int globalmem_open(struct inode *inode, struct file *filp) {
-    struct globalmem_dev* dev = container_of(inode->i_cdev, struct globalmem_dev, cdev);
+    struct globalmem_dev *dev = globalmem_get_dev(iminor(inode));
+
+    if (IS_ERR(dev))
+        return PTR_ERR(dev);
     filp->private_data = dev;
+    // reads and writes honour IOCB_NOWAIT, see read_iter and write_iter
+    filp->f_mode |= FMODE_NOWAIT;
     return 0;
 }
 
@@ -10,60 +20,455 @@ static int globalmem_release(struct inode *inode, struct file *filp) {
     return 0;
 }
 
-static ssize_t globalmem_read(struct file *filp, char __user *buf, size_t size, loff_t *ppos) {
-    unsigned long p = *ppos;
-    unsigned int count = size;
-    int ret = 0;
+// look up the page backing @index, allocating a zeroed one on first use
+static struct page *globalmem_page(struct globalmem_dev *dev, pgoff_t index, gfp_t gfp) {
+    struct page *page, *old;
+
+    page = xa_load(&dev->pages, index);
+    if (page)
+        return page;
+
+    page = alloc_pages_node(dev->node, gfp | __GFP_HIGHMEM | __GFP_ZERO, 0);
+    if (!page)
+        return NULL;
+    // a concurrent writer or page fault may have populated the slot meanwhile
+    old = xa_cmpxchg(&dev->pages, index, NULL, page, gfp);
+    if (old) {
+        __free_page(page);
+        return xa_is_err(old) ? NULL : old;
+    }
+    return page;
+}
+
+// does some snapshot still read page @index from the device
+static bool globalmem_snap_wants(struct globalmem_dev *dev, pgoff_t index) {
+    struct globalmem_snap *snap;
+
+    list_for_each_entry(snap, &dev->snaps, list) {
+        if (index < DIV_ROUND_UP(snap->size, PAGE_SIZE) && !xa_load(&snap->pages, index))
+            return true;
+    }
+    return false;
+}
+
+// hand @page to every snapshot that still reads @index from the device,
+// with layout_sem held
+static int globalmem_snap_keep(struct globalmem_dev *dev, pgoff_t index, struct page *page, gfp_t gfp) {
+    struct globalmem_snap *snap;
+    struct page *old;
+
+    list_for_each_entry(snap, &dev->snaps, list) {
+        if (index >= DIV_ROUND_UP(snap->size, PAGE_SIZE))
+            continue;
+        old = xa_cmpxchg(&snap->pages, index, NULL, page, gfp);
+        if (xa_is_err(old))
+            return xa_err(old);
+        if (!old)
+            get_page(page);
+    }
+    // snapshot readers must find it before the device page changes
+    smp_wmb();
+    return 0;
+}
+
+// about to store to [@pos, @pos + @n): copy the pages there for the
+// snapshots still reading them from the device. called with layout_sem
+// held, before the stripe locks. a store always attempts this before it
+// writes, so whichever copy lands first was taken before any new data
+static int globalmem_cow(struct globalmem_dev *dev, unsigned long pos, size_t n, gfp_t gfp) {
+    unsigned long index;
+    struct page *page, *copy;
+    int ret;
+
+    if (list_empty(&dev->snaps) || !n)
+        return 0;
+    // a hole has nothing to keep, the store gets its page in first
+    xa_for_each_range(&dev->pages, index, page, pos >> PAGE_SHIFT, (pos + n - 1) >> PAGE_SHIFT) {
+        if (!globalmem_snap_wants(dev, index))
+            continue;
+        copy = alloc_pages_node(dev->node, gfp | __GFP_HIGHMEM, 0);
+        if (!copy)
+            return -ENOMEM;
+        copy_highpage(copy, page);
+        ret = globalmem_snap_keep(dev, index, copy, gfp);
+        put_page(copy);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static void globalmem_wait_begin(struct globalmem_dev *dev, unsigned long pos) {
+    this_cpu_inc(dev->stats->waits);
+    trace_globalmem_sleep(dev->minor, pos);
+}
+
+static void globalmem_wait_end(struct globalmem_dev *dev, unsigned long pos) {
+    trace_globalmem_wakeup(dev->minor, pos);
+}
+
+static struct globalmem_stripe *globalmem_stripe(struct globalmem_dev *dev, unsigned long pos, unsigned int shift) {
+    return &dev->stripes[(pos >> shift) & (GLOBALMEM_NR_STRIPES - 1)];
+}
+
+// lock the stripe of @pos, counting and tracing it if that has to sleep
+static void globalmem_stripe_lock(struct globalmem_dev *dev, struct globalmem_stripe *stripe, unsigned long pos) {
+    if (!mutex_trylock(&stripe->lock)) {
+        globalmem_wait_begin(dev, pos);
+        mutex_lock(&stripe->lock);
+        globalmem_wait_end(dev, pos);
+    }
+}
+
+// copy @n bytes at @pos out of the device, holes read as zeros
+static void globalmem_copy_from_dev(struct globalmem_dev *dev, void *to, unsigned long pos, size_t n) {
+    while (n) {
+        unsigned int off = offset_in_page(pos);
+        size_t len = min_t(size_t, n, PAGE_SIZE - off);
+        struct page *page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+
+        if (page)
+            memcpy_from_page(to, page, off, len);
+        else
+            memset(to, 0, len);
+        to += len;
+        pos += len;
+        n -= len;
+    }
+}
+
+// copy @n bytes into the device at @pos, or zero them if @from is NULL.
+// the pages must already exist unless zeroing, holes are zero anyway
+static void globalmem_copy_to_dev(struct globalmem_dev *dev, unsigned long pos, const void *from, size_t n) {
+    while (n) {
+        unsigned int off = offset_in_page(pos);
+        size_t len = min_t(size_t, n, PAGE_SIZE - off);
+        struct page *page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+
+        if (from) {
+            memcpy_to_page(page, off, from, len);
+            from += len;
+        } else if (page) {
+            memzero_page(page, off, len);
+        }
+        pos += len;
+        n -= len;
+    }
+}
+
+// mark the stripes of [@pos, @pos + @n) in @stripes, for 1 << @shift byte
+// stripes
+static void globalmem_stripes_add(unsigned long *stripes, unsigned long pos, size_t n, unsigned int shift) {
+    unsigned long i;
+
+    if (!n)
+        return;
+    for (i = pos >> shift; i <= (pos + n - 1) >> shift && !bitmap_full(stripes, GLOBALMEM_NR_STRIPES); ++i)
+        __set_bit(i & (GLOBALMEM_NR_STRIPES - 1), stripes);
+}
+
+// lock @stripes, always in index order so that two stores can't deadlock.
+// more than one are taken nested in batch_lock for lockdep, a single one
+// goes without it so small stores to disjoint stripes stay parallel
+static void globalmem_stripes_lock(struct globalmem_dev *dev, const unsigned long *stripes, unsigned long pos) {
+    unsigned int i;
+
+    if (bitmap_weight(stripes, GLOBALMEM_NR_STRIPES) == 1) {
+        globalmem_stripe_lock(dev, &dev->stripes[find_first_bit(stripes, GLOBALMEM_NR_STRIPES)], pos);
+        return;
+    }
+    if (!mutex_trylock(&dev->batch_lock)) {
+        globalmem_wait_begin(dev, pos);
+        mutex_lock(&dev->batch_lock);
+        globalmem_wait_end(dev, pos);
+    }
+    for_each_set_bit(i, stripes, GLOBALMEM_NR_STRIPES)
+        mutex_lock_nest_lock(&dev->stripes[i].lock, &dev->batch_lock);
+}
+
+static void globalmem_stripes_unlock(struct globalmem_dev *dev, const unsigned long *stripes) {
+    unsigned int i;
+
+    for_each_set_bit(i, stripes, GLOBALMEM_NR_STRIPES)
+        mutex_unlock(&dev->stripes[i].lock);
+    if (bitmap_weight(stripes, GLOBALMEM_NR_STRIPES) != 1)
+        mutex_unlock(&dev->batch_lock);
+}
+
+// open a write section on each of the locked @stripes, lockless readers of
+// any of them retry until globalmem_store_end(). raw, lockdep would take
+// the seqcounts of two stripes for one taken recursively
+static void globalmem_store_begin(struct globalmem_dev *dev, const unsigned long *stripes) {
+    unsigned int i;
+
+    for_each_set_bit(i, stripes, GLOBALMEM_NR_STRIPES)
+        raw_write_seqcount_begin(&dev->stripes[i].seq);
+}
+
+static void globalmem_store_end(struct globalmem_dev *dev, const unsigned long *stripes) {
+    unsigned int i;
+
+    for_each_set_bit(i, stripes, GLOBALMEM_NR_STRIPES)
+        raw_write_seqcount_end(&dev->stripes[i].seq);
+}
+
+// free every page at or beyond @first, called with layout_sem held exclusive
+static void globalmem_free_pages(struct globalmem_dev *dev, pgoff_t first) {
+    DECLARE_BITMAP(stripes, GLOBALMEM_NR_STRIPES);
+    LIST_HEAD(freelist);
+    struct page *page, *tmp;
+    unsigned long index;
+
+    // the snapshots take the pages over as they are, no copy needed. a
+    // failure would leave them reading zeros
+    if (!list_empty(&dev->snaps)) {
+        xa_for_each_start(&dev->pages, index, page, first)
+            globalmem_snap_keep(dev, index, page, GFP_KERNEL | __GFP_NOFAIL);
+    }
+
+    // no store can race with us, but a lockless read across a page
+    // boundary could find one page erased and the next not yet. every
+    // stripe is in a write section until all of them are gone
+    bitmap_fill(stripes, GLOBALMEM_NR_STRIPES);
+    globalmem_store_begin(dev, stripes);
+    xa_for_each_start(&dev->pages, index, page, first) {
+        xa_erase(&dev->pages, index);
+        list_add(&page->lru, &freelist);
+    }
+    globalmem_store_end(dev, stripes);
+
+    // lockless readers may still be copying out of the erased pages
+    if (list_empty(&freelist))
+        return;
+    synchronize_rcu();
+    list_for_each_entry_safe(page, tmp, &freelist, lru)
+        __free_page(page);
+}
+
+// allocate the pages of [@pos, @pos + @n) ahead of storing to them
+static int globalmem_populate(struct globalmem_dev *dev, unsigned long pos, size_t n, gfp_t gfp) {
+    pgoff_t index;
+
+    if (!n)
+        return 0;
+    for (index = pos >> PAGE_SHIFT; index <= (pos + n - 1) >> PAGE_SHIFT; ++index) {
+        if (!globalmem_page(dev, index, gfp))
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+// store @n bytes at @pos, called with layout_sem held and the pages in
+// place. every stripe a store covers is locked and in its write section
+// before any of it is written, so overlapping stores are ordered as a whole
+// and readers see all of one or none. stores to disjoint stripes run in
+// parallel. past GLOBALMEM_ATOMIC_MAX this goes piece by piece, to bound
+// the non-preemptible section
+static void globalmem_store(struct globalmem_dev *dev, unsigned long pos, const void *from, size_t n) {
+    DECLARE_BITMAP(stripes, GLOBALMEM_NR_STRIPES);
+
+    while (n) {
+        size_t len = min_t(size_t, n, GLOBALMEM_ATOMIC_MAX);
+
+        bitmap_zero(stripes, GLOBALMEM_NR_STRIPES);
+        globalmem_stripes_add(stripes, pos, len, dev->stripe_shift);
+        globalmem_stripes_lock(dev, stripes, pos);
+        globalmem_store_begin(dev, stripes);
+        globalmem_copy_to_dev(dev, pos, from, len);
+        globalmem_store_end(dev, stripes);
+        globalmem_stripes_unlock(dev, stripes);
+
+        if (from)
+            from += len;
+        pos += len;
+        n -= len;
+        // MEM_CLEAR_RANGE can cover the whole 4 GiB
+        cond_resched();
+    }
+}
+
+// copy @n bytes at @pos, at most GLOBALMEM_ATOMIC_MAX, out of the device
+// without a lock. every stripe the range covers is checked, and the whole
+// copy taken again if any of them was stored to meanwhile, so it is never
+// torn by a store
+static void globalmem_load(struct globalmem_dev *dev, void *to, unsigned long pos, size_t n) {
+    DECLARE_BITMAP(stripes, GLOBALMEM_NR_STRIPES);
+    unsigned int seq[GLOBALMEM_NR_STRIPES];
+    unsigned int i;
+
+    for (;;) {
+        // MEM_SET_STRIPE waits for this section before stores use the
+        // new shift, so the stripes we check stay the right ones
+        rcu_read_lock();
+        bitmap_zero(stripes, GLOBALMEM_NR_STRIPES);
+        globalmem_stripes_add(stripes, pos, n, READ_ONCE(dev->stripe_shift));
+        for_each_set_bit(i, stripes, GLOBALMEM_NR_STRIPES)
+            seq[i] = read_seqcount_begin(&dev->stripes[i].seq);
+        globalmem_copy_from_dev(dev, to, pos, n);
+        for_each_set_bit(i, stripes, GLOBALMEM_NR_STRIPES) {
+            if (read_seqcount_retry(&dev->stripes[i].seq, seq[i]))
+                break;
+        }
+        rcu_read_unlock();
+        if (i >= GLOBALMEM_NR_STRIPES)
+            return;
+    }
+}
+
+static ssize_t globalmem_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    unsigned long p = iocb->ki_pos;
+    size_t count = iov_iter_count(to), done = 0;
+    size_t dev_size;
+    ssize_t ret = 0;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    char stack[GLOBALMEM_CHUNK], *buf = stack;
     // get device from file struct
-    struct globalmem_dev *dev = filp->private_data;
+    struct globalmem_dev *dev = iocb->ki_filp->private_data;
 
-    if (p >= GLOBALMEM_SIZE)
+    dev_size = READ_ONCE(dev->size);
+    if (p >= dev_size || !count)
         return 0;
     // get count of readable
-    if (count > GLOBALMEM_SIZE - p)
-        count = GLOBALMEM_SIZE - p;
+    if (count > dev_size - p)
+        count = dev_size - p;
 
-    mutex_lock(&dev->mutex);
-    // copy data from device to user space
-    if (copy_to_user(buf, dev->mem + p, count)) {
-        ret = -EFAULT;
-    } else {
-        *ppos += count;
-        ret = count;
+    // reads of up to GLOBALMEM_ATOMIC_MAX are one snapshot, bigger ones
+    // are taken in pieces of it. the copy below never sleeps, so only
+    // the buffer needs IOCB_NOWAIT care
+    if (min_t(size_t, count, GLOBALMEM_ATOMIC_MAX) > sizeof(stack)) {
+        buf = kvmalloc(min_t(size_t, count, GLOBALMEM_ATOMIC_MAX), nowait ? GFP_NOWAIT : GFP_KERNEL);
+        if (!buf) {
+            buf = stack;
+            ret = nowait ? -EAGAIN : -ENOMEM;
+            goto out;
+        }
+    }
+
+    while (done < count) {
+        size_t n = min_t(size_t, count - done, GLOBALMEM_ATOMIC_MAX), copied;
 
-        printk(KERN_INFO "read %u bytes(s) from %lu\n", count, p);
+        globalmem_load(dev, buf, p + done, n);
+        // copy data from the snapshot to all the user segments
+        copied = copy_to_iter(buf, n, to);
+        done += copied;
+        if (copied != n)
+            break;
     }
-    mutex_unlock(&dev->mutex);
 
+    if (!done)
+        ret = -EFAULT;
+
+out:
+    if (buf != stack)
+        kvfree(buf);
+    if (done) {
+        iocb->ki_pos += done;
+        ret = done;
+        this_cpu_inc(dev->stats->reads);
+        this_cpu_add(dev->stats->read_bytes, done);
+    } else if (ret == -EAGAIN) {
+        this_cpu_inc(dev->stats->eagain);
+    }
+    trace_globalmem_read(dev->minor, p, ret);
     return ret;
 }
 
-static ssize_t globalmem_write(struct file *filp, const char __user *buf, size_t size, loff_t *ppos) {
-    unsigned long p = *ppos;
-    unsigned int count = size;
-    int ret = 0;
-    struct globalmem_dev *dev = filp->private_data;
+static ssize_t globalmem_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    unsigned long p = iocb->ki_pos;
+    size_t count = iov_iter_count(from), done = 0;
+    size_t dev_size;
+    ssize_t ret = 0;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    gfp_t gfp = nowait ? GFP_NOWAIT : GFP_USER;
+    char stack[GLOBALMEM_CHUNK], *buf = stack;
+    struct globalmem_dev *dev = iocb->ki_filp->private_data;
 
-    if (p >= GLOBALMEM_SIZE)
+    dev_size = READ_ONCE(dev->size);
+    if (p >= dev_size)
         return 0;
-    if (count > GLOBALMEM_SIZE - p)
-        count = GLOBALMEM_SIZE - p;
+    if (count > dev_size - p)
+        count = dev_size - p;
 
-    mutex_lock(&dev->mutex);
-    if (copy_from_user(dev->mem + p, buf, count))
-        ret = -EFAULT;
-    else {
-        *ppos += count;
-        ret = count;
+    // a write is staged whole, up to GLOBALMEM_ATOMIC_MAX, and stored in
+    // one go so that overlapping writes can't interleave
+    if (min_t(size_t, count, GLOBALMEM_ATOMIC_MAX) > sizeof(stack)) {
+        buf = kvmalloc(min_t(size_t, count, GLOBALMEM_ATOMIC_MAX), nowait ? GFP_NOWAIT : GFP_KERNEL);
+        if (!buf) {
+            buf = stack;
+            ret = nowait ? -EAGAIN : -ENOMEM;
+            goto out;
+        }
+    }
+
+    while (done < count) {
+        unsigned long pos = p + done;
+        size_t want = min_t(size_t, count - done, GLOBALMEM_ATOMIC_MAX);
+        size_t n;
+
+        // fault the user data in before taking any lock, mmap() of this
+        // device takes layout_sem under mmap_lock
+        n = copy_from_iter(buf, want, from);
+        if (!n) {
+            ret = -EFAULT;
+            break;
+        }
+
+        // the stripe locks below are only held across a short memcpy, so
+        // the only real sleep a NOWAIT write can hit is a resize
+        if (!percpu_down_read_trylock(&dev->layout_sem)) {
+            if (nowait) {
+                ret = -EAGAIN;
+                break;
+            }
+            globalmem_wait_begin(dev, pos);
+            percpu_down_read(&dev->layout_sem);
+            globalmem_wait_end(dev, pos);
+        }
+        // the slots are only written through the KV ioctls
+        if (dev->kv) {
+            percpu_up_read(&dev->layout_sem);
+            ret = -EBUSY;
+            break;
+        }
+        // the device may have shrunk since the size check above
+        if (pos >= dev->size) {
+            percpu_up_read(&dev->layout_sem);
+            break;
+        }
+        n = min_t(size_t, n, dev->size - pos);
+        if (globalmem_populate(dev, pos, n, gfp) || globalmem_cow(dev, pos, n, gfp)) {
+            percpu_up_read(&dev->layout_sem);
+            ret = nowait ? -EAGAIN : -ENOMEM;
+            break;
+        }
+        globalmem_store(dev, pos, buf, n);
+        percpu_up_read(&dev->layout_sem);
+        done += n;
+        // a fault in the user buffer or a shrink ends the write short
+        if (n != want)
+            break;
+    }
 
-        printk(KERN_INFO "written %u bytes(s) from %lu\n", count, p);
+out:
+    if (buf != stack)
+        kvfree(buf);
+    // a short write reports what made it, the error only if nothing did
+    if (done) {
+        iocb->ki_pos += done;
+        ret = done;
+        this_cpu_inc(dev->stats->writes);
+        this_cpu_add(dev->stats->write_bytes, done);
+    } else if (ret == -EAGAIN) {
+        this_cpu_inc(dev->stats->eagain);
     }
-    mutex_unlock(&dev->mutex);
+    trace_globalmem_write(dev->minor, p, ret);
 
     return ret;
 }
 
 static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig) {
+    struct globalmem_dev *dev = filp->private_data;
+    loff_t size = READ_ONCE(dev->size);
     loff_t ret = 0;
     switch (orig) {
     case 0: /* 从文件开头位置seek */
@@ -71,15 +476,15 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig) {
             ret = -EINVAL;
             break;
         }
-        if ((unsigned int)offset > GLOBALMEM_SIZE) {
+        if (offset > size) {
             ret = -EINVAL;
             break;
         }
-        filp->f_pos = (unsigned int)offset;
+        filp->f_pos = offset;
         ret = filp->f_pos;
         break;
     case 1: /* 从文件当前位置开始seek */
-        if ((filp->f_pos + offset) > GLOBALMEM_SIZE) {
+        if ((filp->f_pos + offset) > size) {
             ret = -EINVAL;
             break;
         }
@@ -90,6 +495,14 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig) {
         filp->f_pos += offset;
         ret = filp->f_pos;
         break;
+    case 2: /* 从文件末尾位置seek, 用于获取当前容量 */
+        if (offset > 0 || (size + offset) < 0) {
+            ret = -EINVAL;
+            break;
+        }
+        filp->f_pos = size + offset;
+        ret = filp->f_pos;
+        break;
     default:
         ret = -EINVAL;
         break;
@@ -97,87 +510,946 @@ static loff_t globalmem_llseek(struct file *filp, loff_t offset, int orig) {
     return ret;
 }
 
+// change the capacity, called with layout_sem held exclusive and no mappings
+static int globalmem_resize(struct globalmem_dev *dev, size_t size) {
+    if (size < dev->size) {
+        if (offset_in_page(size) && globalmem_cow(dev, size, 1, GFP_USER))
+            return -ENOMEM;
+        globalmem_free_pages(dev, DIV_ROUND_UP(size, PAGE_SIZE));
+        // zero the cut-off tail so that growing again exposes zeros
+        if (offset_in_page(size))
+            globalmem_store(dev, size, NULL, PAGE_SIZE - offset_in_page(size));
+    }
+    WRITE_ONCE(dev->size, size);
+    return 0;
+}
+
+// switch to 1 << @shift byte stripes, called with layout_sem held exclusive
+static void globalmem_set_stripe(struct globalmem_dev *dev, unsigned int shift) {
+    WRITE_ONCE(dev->stripe_shift, shift);
+    // readers pick the stripe under rcu_read_lock(), wait for the ones still
+    // checking a stripe picked with the old shift before stores resume
+    synchronize_rcu();
+}
+
+// bytes of @op that fall inside the device, called with layout_sem held
+static size_t globalmem_batch_len(struct globalmem_dev *dev, struct globalmem_batch_op *op) {
+    if (op->result || op->offset >= dev->size)
+        return 0;
+    return min_t(u64, op->len, dev->size - op->offset);
+}
+
+// MEM_BATCH. the data moves through a kernel buffer, so nothing faults
+// while the stripes are held: writes are copied in before taking them,
+// reads copied out after letting go. every stripe the batch touches is
+// held throughout and the written ones stay in one write section, so
+// stores and readers see the batch whole, and its reads see no store
+// of up to GLOBALMEM_ATOMIC_MAX half done
+static long globalmem_batch(struct globalmem_dev *dev, struct globalmem_batch __user *ubatch) {
+    DECLARE_BITMAP(held, GLOBALMEM_NR_STRIPES);
+    DECLARE_BITMAP(dirty, GLOBALMEM_NR_STRIPES);
+    struct globalmem_batch batch;
+    struct globalmem_batch_op *ops;
+    size_t total = 0, off;
+    char *data;
+    u32 i;
+    long ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (!batch.nr || batch.nr > GLOBALMEM_BATCH_MAX_OPS)
+        return -EINVAL;
+    ops = memdup_user(u64_to_user_ptr(batch.ops), batch.nr * sizeof(*ops));
+    if (IS_ERR(ops))
+        return PTR_ERR(ops);
+
+    for (i = 0; i < batch.nr; ++i) {
+        if (ops[i].len > GLOBALMEM_BATCH_MAX_BYTES - total) {
+            ret = -E2BIG;
+            goto out_ops;
+        }
+        total += ops[i].len;
+        ops[i].result = 0;
+        if (ops[i].op != GLOBALMEM_BATCH_READ && ops[i].op != GLOBALMEM_BATCH_WRITE)
+            ops[i].result = -EINVAL;
+    }
+    data = kvmalloc(max_t(size_t, total, 1), GFP_KERNEL);
+    if (!data) {
+        ret = -ENOMEM;
+        goto out_ops;
+    }
+    for (i = 0, off = 0; i < batch.nr; off += ops[i].len, ++i) {
+        if (!ops[i].result && ops[i].op == GLOBALMEM_BATCH_WRITE &&
+            copy_from_user(data + off, u64_to_user_ptr(ops[i].buf), ops[i].len))
+            ops[i].result = -EFAULT;
+    }
+
+    percpu_down_read(&dev->layout_sem);
+    if (dev->kv) {
+        percpu_up_read(&dev->layout_sem);
+        ret = -EBUSY;
+        goto out_data;
+    }
+    // populate the pages to be written and note the stripes to take, both
+    // while allocating may still sleep
+    bitmap_zero(held, GLOBALMEM_NR_STRIPES);
+    bitmap_zero(dirty, GLOBALMEM_NR_STRIPES);
+    for (i = 0; i < batch.nr; ++i) {
+        size_t n = globalmem_batch_len(dev, &ops[i]);
+
+        if (!n)
+            continue;
+        if (ops[i].op == GLOBALMEM_BATCH_WRITE &&
+            (globalmem_populate(dev, ops[i].offset, n, GFP_USER) ||
+             globalmem_cow(dev, ops[i].offset, n, GFP_USER))) {
+            ops[i].result = -ENOMEM;
+            continue;
+        }
+        globalmem_stripes_add(held, ops[i].offset, n, dev->stripe_shift);
+        if (ops[i].op == GLOBALMEM_BATCH_WRITE)
+            globalmem_stripes_add(dirty, ops[i].offset, n, dev->stripe_shift);
+    }
+
+    globalmem_stripes_lock(dev, held, 0);
+    globalmem_store_begin(dev, dirty);
+    for (i = 0, off = 0; i < batch.nr; off += ops[i].len, ++i) {
+        size_t n = globalmem_batch_len(dev, &ops[i]);
+
+        if (ops[i].result)
+            continue;
+        if (ops[i].op == GLOBALMEM_BATCH_WRITE)
+            globalmem_copy_to_dev(dev, ops[i].offset, data + off, n);
+        else
+            globalmem_copy_from_dev(dev, data + off, ops[i].offset, n);
+        ops[i].result = n;
+    }
+    globalmem_store_end(dev, dirty);
+    globalmem_stripes_unlock(dev, held);
+    percpu_up_read(&dev->layout_sem);
+
+    for (i = 0, off = 0; i < batch.nr; off += ops[i].len, ++i) {
+        if (ops[i].result > 0 && ops[i].op == GLOBALMEM_BATCH_READ &&
+            copy_to_user(u64_to_user_ptr(ops[i].buf), data + off, ops[i].result))
+            ops[i].result = -EFAULT;
+    }
+    if (copy_to_user(u64_to_user_ptr(batch.ops), ops, batch.nr * sizeof(*ops)))
+        ret = -EFAULT;
+
+out_data:
+    kvfree(data);
+out_ops:
+    kfree(ops);
+    return ret;
+}
+
+// the update itself. a cmpxchg loop, so that processes using atomics on
+// a mapping of the same bytes see it as one too
+static u32 globalmem_atomic32(u32 *p, unsigned int cmd, u32 val, u32 expect) {
+    u32 old, new;
+
+    do {
+        old = READ_ONCE(*p);
+        if (cmd == MEM_CAS && old != expect)
+            break;
+        new = cmd == MEM_FETCH_ADD ? old + val : val;
+    } while (cmpxchg(p, old, new) != old);
+    return old;
+}
+
+static u64 globalmem_atomic64(u64 *p, unsigned int cmd, u64 val, u64 expect) {
+    u64 old, new;
+
+    do {
+        old = READ_ONCE(*p);
+        if (cmd == MEM_CAS && old != expect)
+            break;
+        new = cmd == MEM_FETCH_ADD ? old + val : val;
+    } while (cmpxchg64(p, old, new) != old);
+    return old;
+}
+
+// MEM_CAS, MEM_FETCH_ADD and MEM_XCHG. an aligned value never crosses a
+// stripe or a page, so its stripe lock keeps the other writers out and
+// the seqcount sends lockless readers round again
+static long globalmem_atomic(struct globalmem_dev *dev, unsigned int cmd, struct globalmem_atomic __user *uarg) {
+    struct globalmem_atomic arg;
+    struct globalmem_stripe *stripe;
+    struct page *page;
+    void *addr;
+    long ret = 0;
+
+    if (copy_from_user(&arg, uarg, sizeof(arg)))
+        return -EFAULT;
+    if ((arg.size != sizeof(u32) && arg.size != sizeof(u64)) || !IS_ALIGNED(arg.offset, arg.size))
+        return -EINVAL;
+
+    percpu_down_read(&dev->layout_sem);
+    if (dev->kv) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (arg.offset >= dev->size || dev->size - arg.offset < arg.size) {
+        ret = -EINVAL;
+        goto out;
+    }
+    // a hole reads as zero, it needs a page to be updated in
+    page = globalmem_page(dev, arg.offset >> PAGE_SHIFT, GFP_USER);
+    if (!page || globalmem_cow(dev, arg.offset, arg.size, GFP_USER)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    stripe = globalmem_stripe(dev, arg.offset, dev->stripe_shift);
+    globalmem_stripe_lock(dev, stripe, arg.offset);
+    addr = kmap_local_page(page) + offset_in_page(arg.offset);
+    write_seqcount_begin(&stripe->seq);
+    if (arg.size == sizeof(u32))
+        arg.old = globalmem_atomic32(addr, cmd, arg.val, arg.expect);
+    else
+        arg.old = globalmem_atomic64(addr, cmd, arg.val, arg.expect);
+    write_seqcount_end(&stripe->seq);
+    kunmap_local(addr);
+    mutex_unlock(&stripe->lock);
+
+out:
+    percpu_up_read(&dev->layout_sem);
+    if (!ret && put_user(arg.old, &uarg->old))
+        ret = -EFAULT;
+    return ret;
+}
+
+// KV mode. lookups run under rcu_read_lock() alone, the pages are only
+// freed after a grace period. each slot carries its own seqcount in seq:
+// writers claim a slot by moving seq to odd with a cmpxchg and publish it
+// by moving it on to even, readers copy the slot and retry if seq moved.
+// writers of a key also hold the stripe lock of its home slot, so two
+// puts of the same key can't both miss it and insert it twice
+
+static unsigned long globalmem_kv_home(struct globalmem_dev *dev, const struct globalmem_kv *kv) {
+    return jhash(kv->key, kv->klen, 0) % (dev->size / GLOBALMEM_KV_SLOT);
+}
+
+// a stable copy of slot @index, all zero (empty) for a hole. called under
+// rcu_read_lock() or with layout_sem held
+static void globalmem_kv_load(struct globalmem_dev *dev, unsigned long index, struct globalmem_kv_slot *slot) {
+    unsigned long pos = index * GLOBALMEM_KV_SLOT;
+    struct globalmem_kv_slot *p;
+    struct page *page;
+    u32 seq;
+
+    page = xa_load(&dev->pages, pos >> PAGE_SHIFT);
+    if (!page) {
+        memset(slot, 0, sizeof(*slot));
+        return;
+    }
+    p = kmap_local_page(page) + offset_in_page(pos);
+    for (;;) {
+        seq = smp_load_acquire(&p->seq);
+        if (!(seq & 1)) {
+            memcpy(slot, p, sizeof(*slot));
+            smp_rmb();
+            if (READ_ONCE(p->seq) == seq)
+                break;
+        }
+        // writers hold a slot with preemption off, never for long
+        cpu_relax();
+    }
+    kunmap_local(p);
+}
+
+static bool globalmem_kv_match(const struct globalmem_kv_slot *slot, const struct globalmem_kv *kv) {
+    return slot->state == GLOBALMEM_KV_USED && slot->klen == kv->klen &&
+           !memcmp(slot->key, kv->key, kv->klen);
+}
+
+// slots a key may be found in, from its home on
+static unsigned long globalmem_kv_probe(struct globalmem_dev *dev) {
+    return min_t(unsigned long, dev->size / GLOBALMEM_KV_SLOT, GLOBALMEM_KV_MAX_PROBE);
+}
+
+// look @kv up and fill in its value, under rcu_read_lock()
+static bool globalmem_kv_lookup(struct globalmem_dev *dev, struct globalmem_kv *kv) {
+    unsigned long nslots = dev->size / GLOBALMEM_KV_SLOT;
+    unsigned long home = globalmem_kv_home(dev, kv), i;
+    struct globalmem_kv_slot slot;
+
+    for (i = 0; i < globalmem_kv_probe(dev); ++i) {
+        globalmem_kv_load(dev, (home + i) % nslots, &slot);
+        if (slot.state == GLOBALMEM_KV_EMPTY)
+            break;
+        if (globalmem_kv_match(&slot, kv)) {
+            // the bytes may have been written while not in KV mode
+            kv->vlen = min_t(u8, slot.vlen, GLOBALMEM_KV_VAL_MAX);
+            memcpy(kv->val, slot.val, kv->vlen);
+            return true;
+        }
+    }
+    return false;
+}
+
+// rewrite slot @index if its seq is still @seq, with layout_sem held and
+// the page in place. @kv NULL marks it deleted
+static bool globalmem_kv_store(struct globalmem_dev *dev, unsigned long index, u32 seq,
+                               const struct globalmem_kv *kv) {
+    unsigned long pos = index * GLOBALMEM_KV_SLOT;
+    struct globalmem_kv_slot *p;
+    bool ret = false;
+
+    p = kmap_local_page(xa_load(&dev->pages, pos >> PAGE_SHIFT)) + offset_in_page(pos);
+    preempt_disable();
+    if (cmpxchg(&p->seq, seq, seq + 1) == seq) {
+        if (kv) {
+            p->state = GLOBALMEM_KV_USED;
+            p->klen = kv->klen;
+            p->vlen = kv->vlen;
+            memcpy(p->key, kv->key, kv->klen);
+            memcpy(p->val, kv->val, kv->vlen);
+        } else {
+            p->state = GLOBALMEM_KV_DELETED;
+        }
+        smp_store_release(&p->seq, seq + 2);
+        ret = true;
+    }
+    preempt_enable();
+    kunmap_local(p);
+    return ret;
+}
+
+// MEM_KV_PUT (@kv) and MEM_KV_DEL (@del), with layout_sem held in KV mode
+static long globalmem_kv_update(struct globalmem_dev *dev, const struct globalmem_kv *kv, bool del) {
+    unsigned long nslots = dev->size / GLOBALMEM_KV_SLOT;
+    unsigned long home = globalmem_kv_home(dev, kv), index, i;
+    struct globalmem_stripe *stripe = globalmem_stripe(dev, home * GLOBALMEM_KV_SLOT, dev->stripe_shift);
+    struct globalmem_kv_slot slot;
+    long ret;
+
+    globalmem_stripe_lock(dev, stripe, home * GLOBALMEM_KV_SLOT);
+again:
+    // the key's own slot if it has one, or else the first free one
+    index = ULONG_MAX;
+    for (i = 0; i < globalmem_kv_probe(dev); ++i) {
+        globalmem_kv_load(dev, (home + i) % nslots, &slot);
+        if (globalmem_kv_match(&slot, kv)) {
+            index = (home + i) % nslots;
+            break;
+        }
+        if (slot.state != GLOBALMEM_KV_USED && index == ULONG_MAX)
+            index = (home + i) % nslots;
+        if (slot.state == GLOBALMEM_KV_EMPTY)
+            break;
+    }
+    if (del && (index == ULONG_MAX || !globalmem_kv_match(&slot, kv))) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if (index == ULONG_MAX) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    // the free slot we found isn't the last one loaded
+    if (!globalmem_kv_match(&slot, kv))
+        globalmem_kv_load(dev, index, &slot);
+    if (!globalmem_page(dev, index * GLOBALMEM_KV_SLOT >> PAGE_SHIFT, GFP_USER)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    // a put of another key may have taken the free slot meanwhile
+    if (!globalmem_kv_store(dev, index, slot.seq, del ? NULL : kv))
+        goto again;
+    ret = 0;
+out:
+    mutex_unlock(&stripe->lock);
+    return ret;
+}
+
+static bool globalmem_kv_valid(const struct globalmem_kv *kv) {
+    return kv->klen && kv->klen <= GLOBALMEM_KV_KEY_MAX && kv->vlen <= GLOBALMEM_KV_VAL_MAX;
+}
+
+static long globalmem_kv_get(struct globalmem_dev *dev, struct globalmem_kv __user *ukv) {
+    struct globalmem_kv kv;
+    long ret = 0;
+
+    if (copy_from_user(&kv, ukv, sizeof(kv)))
+        return -EFAULT;
+    kv.vlen = 0;
+    if (!globalmem_kv_valid(&kv))
+        return -EINVAL;
+
+    rcu_read_lock();
+    if (!READ_ONCE(dev->kv))
+        ret = -EINVAL;
+    else if (!globalmem_kv_lookup(dev, &kv))
+        ret = -ENOENT;
+    rcu_read_unlock();
+
+    if (!ret && copy_to_user(ukv, &kv, sizeof(kv)))
+        ret = -EFAULT;
+    return ret;
+}
+
+static long globalmem_kv_mget(struct globalmem_dev *dev, struct globalmem_kv_mget __user *umget) {
+    struct globalmem_kv_mget mget;
+    struct globalmem_kv *kvs;
+    long ret = 0;
+    u32 i;
+
+    if (copy_from_user(&mget, umget, sizeof(mget)))
+        return -EFAULT;
+    if (!mget.nr || mget.nr > GLOBALMEM_KV_MGET_MAX)
+        return -EINVAL;
+    kvs = memdup_user(u64_to_user_ptr(mget.kvs), mget.nr * sizeof(*kvs));
+    if (IS_ERR(kvs))
+        return PTR_ERR(kvs);
+
+    // a read section per key keeps each one short
+    for (i = 0; i < mget.nr; ++i) {
+        rcu_read_lock();
+        if (!READ_ONCE(dev->kv)) {
+            rcu_read_unlock();
+            ret = -EINVAL;
+            break;
+        }
+        kvs[i].vlen = 0;
+        kvs[i].found = globalmem_kv_valid(&kvs[i]) && globalmem_kv_lookup(dev, &kvs[i]);
+        ret += kvs[i].found;
+        rcu_read_unlock();
+        cond_resched();
+    }
+
+    if (ret >= 0 && copy_to_user(u64_to_user_ptr(mget.kvs), kvs, mget.nr * sizeof(*kvs)))
+        ret = -EFAULT;
+    kfree(kvs);
+    return ret;
+}
+
+static long globalmem_kv_put(struct globalmem_dev *dev, struct globalmem_kv __user *ukv, bool del) {
+    struct globalmem_kv kv;
+    long ret;
+
+    if (copy_from_user(&kv, ukv, sizeof(kv)))
+        return -EFAULT;
+    if (del)
+        kv.vlen = 0;
+    if (!globalmem_kv_valid(&kv))
+        return -EINVAL;
+
+    percpu_down_read(&dev->layout_sem);
+    ret = dev->kv ? globalmem_kv_update(dev, &kv, del) : -EINVAL;
+    percpu_up_read(&dev->layout_sem);
+    return ret;
+}
+
+// MEM_SET_KV, with layout_sem held exclusive
+static long globalmem_set_kv(struct globalmem_dev *dev, bool kv) {
+    if (kv == dev->kv)
+        return 0;
+    if (kv) {
+        // user space can't be left scribbling over the slots, and slot
+        // stores don't copy for snapshots
+        if (atomic_read(&dev->mmap_count) || !list_empty(&dev->snaps))
+            return -EBUSY;
+        if (dev->size < GLOBALMEM_KV_SLOT)
+            return -EINVAL;
+        // start from an empty table, holes are empty slots
+        globalmem_free_pages(dev, 0);
+        WRITE_ONCE(dev->kv, true);
+    } else {
+        WRITE_ONCE(dev->kv, false);
+        // lookups that still saw KV mode are done before byte stores resume
+        synchronize_rcu();
+    }
+    return 0;
+}
+
+static ssize_t globalmem_snap_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct globalmem_snap *snap = iocb->ki_filp->private_data;
+    unsigned long p = iocb->ki_pos;
+    size_t count = iov_iter_count(to), done = 0;
+    char buf[GLOBALMEM_CHUNK];
+
+    if (p >= snap->size || !count)
+        return 0;
+    if (count > snap->size - p)
+        count = snap->size - p;
+
+    while (done < count) {
+        unsigned long pos = p + done;
+        size_t n = min_t(size_t, min_t(size_t, count - done, GLOBALMEM_CHUNK), PAGE_SIZE - offset_in_page(pos));
+        struct page *page;
+        size_t copied;
+
+        rcu_read_lock();
+        page = xa_load(&snap->pages, pos >> PAGE_SHIFT);
+        if (!page) {
+            // what the device has is still ours, unless a copy was put
+            // in while we read it. a store puts it in before writing
+            globalmem_copy_from_dev(snap->dev, buf, pos, n);
+            smp_rmb();
+            page = xa_load(&snap->pages, pos >> PAGE_SHIFT);
+        }
+        if (page)
+            memcpy_from_page(buf, page, offset_in_page(pos), n);
+        rcu_read_unlock();
+
+        copied = copy_to_iter(buf, n, to);
+        done += copied;
+        if (copied != n)
+            break;
+    }
+
+    if (!done)
+        return -EFAULT;
+    iocb->ki_pos += done;
+    return done;
+}
+
+static loff_t globalmem_snap_llseek(struct file *filp, loff_t offset, int orig) {
+    struct globalmem_snap *snap = filp->private_data;
+
+    return fixed_size_llseek(filp, offset, orig, snap->size);
+}
+
+static void globalmem_snap_free(struct globalmem_snap *snap) {
+    struct globalmem_dev *dev = snap->dev;
+    struct page *page;
+    unsigned long index;
+
+    // no store is between its copy and its write once we hold this
+    percpu_down_write(&dev->layout_sem);
+    list_del(&snap->list);
+    percpu_up_write(&dev->layout_sem);
+
+    xa_for_each(&snap->pages, index, page)
+        put_page(page);
+    xa_destroy(&snap->pages);
+    kfree(snap);
+}
+
+static int globalmem_snap_release(struct inode *inode, struct file *filp) {
+    globalmem_snap_free(filp->private_data);
+    return 0;
+}
+
+static const struct file_operations globalmem_snap_fops = {
+    .owner = THIS_MODULE,
+    .llseek = globalmem_snap_llseek,
+    .read_iter = globalmem_snap_read_iter,
+    .release = globalmem_snap_release,
+};
+
+// MEM_SNAPSHOT: freeze the device as it is now behind a new read-only fd.
+// nothing is copied up front, see globalmem_cow()
+static long globalmem_snapshot(struct globalmem_dev *dev) {
+    struct globalmem_snap *snap;
+    struct file *file;
+    int fd;
+
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+    snap->dev = dev;
+    xa_init(&snap->pages);
+
+    percpu_down_write(&dev->layout_sem);
+    // stores through a mapping or to KV slots don't copy
+    if (atomic_read(&dev->mmap_count) || dev->kv) {
+        percpu_up_write(&dev->layout_sem);
+        kfree(snap);
+        return -EBUSY;
+    }
+    snap->size = dev->size;
+    list_add(&snap->list, &dev->snaps);
+    percpu_up_write(&dev->layout_sem);
+
+    fd = get_unused_fd_flags(O_CLOEXEC);
+    if (fd < 0) {
+        globalmem_snap_free(snap);
+        return fd;
+    }
+    file = anon_inode_getfile("[globalmem-snapshot]", &globalmem_snap_fops, snap, O_RDONLY);
+    if (IS_ERR(file)) {
+        put_unused_fd(fd);
+        globalmem_snap_free(snap);
+        return PTR_ERR(file);
+    }
+    file->f_mode |= FMODE_PREAD;
+    fd_install(fd, file);
+    return fd;
+}
+
 static long globalmem_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     struct globalmem_dev *dev = filp->private_data;
+    struct globalmem_range range;
+    struct page *page;
+    unsigned long index;
+    u64 size;
+    u32 stripe, kv;
+    long ret = 0;
 
     switch (cmd) {
     case MEM_CLEAR:
-        mutex_lock(&dev->mutex);
-        memset(dev->mem, 0, GLOBALMEM_SIZE);
-        mutex_unlock(&dev->mutex);
-        printk(KERN_INFO "globalmem is set to zero\n");
+        percpu_down_write(&dev->layout_sem);
+        if (atomic_read(&dev->mmap_count)) {
+            // mapped pages stay in place, user space still references them
+            xa_for_each(&dev->pages, index, page)
+                globalmem_store(dev, index << PAGE_SHIFT, NULL, PAGE_SIZE);
+        } else {
+            // unmapped pages go back to the allocator and read as zeros
+            globalmem_free_pages(dev, 0);
+        }
+        trace_globalmem_clear(dev->minor, 0, dev->size);
+        percpu_up_write(&dev->layout_sem);
+        break;
+
+    case MEM_CLEAR_RANGE:
+        if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+            return -EFAULT;
+
+        // runs in parallel with writers and clears of other stripes
+        percpu_down_read(&dev->layout_sem);
+        if (dev->kv) {
+            ret = -EBUSY;
+        } else if (range.offset > dev->size || range.len > dev->size - range.offset) {
+            ret = -EINVAL;
+        } else {
+            // zeroing a hole stores nothing, so only pages need copying
+            ret = globalmem_cow(dev, range.offset, range.len, GFP_USER);
+            if (!ret) {
+                globalmem_store(dev, range.offset, NULL, range.len);
+                trace_globalmem_clear(dev->minor, range.offset, range.len);
+            }
+        }
+        percpu_up_read(&dev->layout_sem);
+        break;
+
+    case MEM_RESIZE:
+        if (get_user(size, (u64 __user *)arg))
+            return -EFAULT;
+        if (!size || size > GLOBALMEM_MAX_SIZE)
+            return -EINVAL;
+
+        percpu_down_write(&dev->layout_sem);
+        // the slot count is part of the hash
+        if (atomic_read(&dev->mmap_count) || dev->kv) {
+            ret = -EBUSY;
+        } else {
+            ret = globalmem_resize(dev, size);
+            if (!ret)
+                printk(KERN_INFO "globalmem is resized to %llu bytes\n", size);
+        }
+        percpu_up_write(&dev->layout_sem);
+        break;
+
+    case MEM_BATCH:
+        return globalmem_batch(dev, (struct globalmem_batch __user *)arg);
+
+    case MEM_CAS:
+    case MEM_FETCH_ADD:
+    case MEM_XCHG:
+        return globalmem_atomic(dev, cmd, (struct globalmem_atomic __user *)arg);
+
+    case MEM_SET_KV:
+        if (get_user(kv, (u32 __user *)arg))
+            return -EFAULT;
+        if (kv > 1)
+            return -EINVAL;
+
+        percpu_down_write(&dev->layout_sem);
+        ret = globalmem_set_kv(dev, kv);
+        percpu_up_write(&dev->layout_sem);
+        break;
+
+    case MEM_SNAPSHOT:
+        return globalmem_snapshot(dev);
+
+    case MEM_KV_GET:
+        return globalmem_kv_get(dev, (struct globalmem_kv __user *)arg);
+
+    case MEM_KV_MGET:
+        return globalmem_kv_mget(dev, (struct globalmem_kv_mget __user *)arg);
+
+    case MEM_KV_PUT:
+    case MEM_KV_DEL:
+        return globalmem_kv_put(dev, (struct globalmem_kv __user *)arg, cmd == MEM_KV_DEL);
+
+    case MEM_SET_STRIPE:
+        if (get_user(stripe, (u32 __user *)arg))
+            return -EFAULT;
+        if (!is_power_of_2(stripe) || stripe < GLOBALMEM_MIN_STRIPE ||
+            stripe > GLOBALMEM_MAX_STRIPE)
+            return -EINVAL;
+
+        percpu_down_write(&dev->layout_sem);
+        globalmem_set_stripe(dev, ilog2(stripe));
+        percpu_up_write(&dev->layout_sem);
         break;
 
     default:
         return -EINVAL;
     }
 
+    return ret;
+}
+
+static void globalmem_vm_open(struct vm_area_struct *vma) {
+    struct globalmem_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mmap_count);
+}
+
+static void globalmem_vm_close(struct vm_area_struct *vma) {
+    struct globalmem_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mmap_count);
+}
+
+static vm_fault_t globalmem_vm_fault(struct vm_fault *vmf) {
+    struct globalmem_dev *dev = vmf->vma->vm_private_data;
+    struct page *page;
+
+    // the capacity can't shrink while mapped, see MEM_RESIZE
+    if (vmf->pgoff >= DIV_ROUND_UP(dev->size, PAGE_SIZE))
+        return VM_FAULT_SIGBUS;
+
+    // pages are populated on first touch, just like on first write()
+    page = globalmem_page(dev, vmf->pgoff, GFP_USER);
+    if (!page)
+        return VM_FAULT_OOM;
+    get_page(page);
+    vmf->page = page;
     return 0;
 }
 
+static const struct vm_operations_struct globalmem_vm_ops = {
+    .open = globalmem_vm_open,
+    .close = globalmem_vm_close,
+    .fault = globalmem_vm_fault,
+};
+
+static int globalmem_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct globalmem_dev *dev = filp->private_data;
+    int ret = 0;
+
+    percpu_down_read(&dev->layout_sem);
+    // stores through a mapping would get past the snapshots
+    if (dev->kv || !list_empty(&dev->snaps)) {
+        ret = -EBUSY;
+    } else if (vma->vm_pgoff + vma_pages(vma) > DIV_ROUND_UP(dev->size, PAGE_SIZE)) {
+        ret = -EINVAL;
+    } else {
+        // map the device pages straight into user space, no copy on access
+        vma->vm_ops = &globalmem_vm_ops;
+        vma->vm_private_data = dev;
+        vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+        globalmem_vm_open(vma);
+    }
+    percpu_up_read(&dev->layout_sem);
+
+    return ret;
+}
+
 static const struct file_operations globalmem_fops = {
     .owner = THIS_MODULE,
     .llseek = globalmem_llseek,
-    .read = globalmem_read,
-    .write = globalmem_write,
+    .read_iter = globalmem_read_iter,
+    .write_iter = globalmem_write_iter,
     .unlocked_ioctl = globalmem_ioctl,
+    .mmap = globalmem_mmap,
     .open = globalmem_open,
     .release = globalmem_release,
 };
 
-static void globalmem_setup_cdev(struct globalmem_dev* dev, int index) {
-    int err, devno = MKDEV(globalmem_major, index);
+static int globalmem_stats_show(struct seq_file *m, void *v) {
+    struct globalmem_dev *dev = m->private;
+    struct globalmem_stats sum = {};
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct globalmem_stats *stats = per_cpu_ptr(dev->stats, cpu);
+
+        sum.reads += stats->reads;
+        sum.read_bytes += stats->read_bytes;
+        sum.writes += stats->writes;
+        sum.write_bytes += stats->write_bytes;
+        sum.waits += stats->waits;
+        sum.eagain += stats->eagain;
+    }
+    seq_printf(m, "reads: %llu\nread_bytes: %llu\nwrites: %llu\nwrite_bytes: %llu\n"
+               "waits: %llu\neagain: %llu\n", sum.reads, sum.read_bytes, sum.writes,
+               sum.write_bytes, sum.waits, sum.eagain);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(globalmem_stats);
+
+// <debugfs>/globalmem/globalmemN/
+static void globalmem_debugfs_init(struct globalmem_dev *dev, int index) {
+    char name[32];
+    struct dentry *dir;
+
+    snprintf(name, sizeof(name), "globalmem%d", index);
+    dir = debugfs_create_dir(name, globalmem_debugfs);
+    debugfs_create_file("stats", 0444, dir, dev, &globalmem_stats_fops);
+}
+
+static int globalmem_setup_cdev(void) {
+    int err;
 
     // init cdev, connect file_operation to cdev
-    cdev_init(&dev->cdev, &globalmem_fops);
-    dev->cdev.owner = THIS_MODULE;
-    // rigister a cdev to system
-    err = cdev_add(&dev->cdev, devno, 1);
+    cdev_init(&globalmem_cdev, &globalmem_fops);
+    globalmem_cdev.owner = THIS_MODULE;
+    // one cdev for all the minors, the devices come with their first open
+    err = cdev_add(&globalmem_cdev, MKDEV(globalmem_major, 0), globalmem_nr_devs);
     if (err) {
-        printk(KERN_NOTICE "Error %d adding globalmem%d", err, index);
+        printk(KERN_NOTICE "Error %d adding globalmem", err);
+    }
+    return err;
+}
+
+// the NUMA node for @minor's memory, see globalmem_node. called by its first
+// opener
+static int globalmem_dev_node(unsigned int minor) {
+    int node = NUMA_NO_NODE;
+
+    if (globalmem_nr_node)
+        node = globalmem_node[min_t(unsigned int, minor, globalmem_nr_node - 1)];
+    // a node may have gone offline since the module was loaded
+    if (node == NUMA_NO_NODE || !node_online(node))
+        node = numa_node_id();
+    return node;
+}
+
+static int globalmem_init_dev(struct globalmem_dev *dev, int minor, int node) {
+    int i, ret;
+
+    // pages are only allocated once written, so nothing else to allocate
+    dev->minor = minor;
+    dev->node = node;
+    xa_init(&dev->pages);
+    dev->size = globalmem_size;
+    dev->stripe_shift = PAGE_SHIFT;
+    INIT_LIST_HEAD(&dev->snaps);
+    for (i = 0; i < GLOBALMEM_NR_STRIPES; ++i) {
+        mutex_init(&dev->stripes[i].lock);
+        seqcount_mutex_init(&dev->stripes[i].seq, &dev->stripes[i].lock);
+    }
+    mutex_init(&dev->batch_lock);
+    dev->stats = alloc_percpu(struct globalmem_stats);
+    if (!dev->stats)
+        return -ENOMEM;
+    ret = percpu_init_rwsem(&dev->layout_sem);
+    if (ret)
+        free_percpu(dev->stats);
+    return ret;
+}
+
+static void globalmem_free_dev(struct globalmem_dev *dev) {
+    globalmem_free_pages(dev, 0);
+    xa_destroy(&dev->pages);
+    percpu_free_rwsem(&dev->layout_sem);
+    free_percpu(dev->stats);
+    kmem_cache_free(globalmem_cachep, dev);
+}
+
+// the device behind @minor, allocated on its first open. until then a
+// minor costs one pointer
+static struct globalmem_dev *globalmem_get_dev(unsigned int minor) {
+    struct globalmem_dev *dev;
+    int node, ret;
+
+    // pairs with the release below, a device seen here is set up
+    dev = smp_load_acquire(&globalmem_devs[minor]);
+    if (dev)
+        return dev;
+
+    mutex_lock(&globalmem_devs_lock);
+    dev = globalmem_devs[minor];
+    if (dev)
+        goto out;
+    node = globalmem_dev_node(minor);
+    dev = kmem_cache_alloc_node(globalmem_cachep, GFP_KERNEL | __GFP_ZERO, node);
+    if (!dev) {
+        dev = ERR_PTR(-ENOMEM);
+        goto out;
+    }
+    ret = globalmem_init_dev(dev, minor, node);
+    if (ret) {
+        kmem_cache_free(globalmem_cachep, dev);
+        dev = ERR_PTR(ret);
+        goto out;
     }
+    globalmem_debugfs_init(dev, minor);
+    smp_store_release(&globalmem_devs[minor], dev);
+out:
+    mutex_unlock(&globalmem_devs_lock);
+    return dev;
 }
 
 static int __init globalmem_init(void) {
     int ret = 0;
-    int i = 0;
+    int i;
     dev_t devno = MKDEV(globalmem_major, 0);
+
+    if (!globalmem_size || globalmem_size > GLOBALMEM_MAX_SIZE)
+        return -EINVAL;
+    if (!globalmem_nr_devs || globalmem_nr_devs > MINORMASK + 1)
+        return -EINVAL;
+    for (i = 0; i < globalmem_nr_node; ++i) {
+        if (globalmem_node[i] != NUMA_NO_NODE &&
+            (globalmem_node[i] < 0 || globalmem_node[i] >= MAX_NUMNODES || !node_online(globalmem_node[i])))
+            return -EINVAL;
+    }
+
     // request a devno
     if (globalmem_major) {
-        ret = register_chrdev_region(devno, DEVICE_NUM, "globalmem");
+        ret = register_chrdev_region(devno, globalmem_nr_devs, "globalmem");
     } else {
-        ret = alloc_chrdev_region(&devno, 0, DEVICE_NUM, "globalmem");
+        ret = alloc_chrdev_region(&devno, 0, globalmem_nr_devs, "globalmem");
         globalmem_major = MAJOR(devno);
     }
 
     if (ret < 0) return ret;
 
-    globalmem_devp = kzalloc(sizeof(struct globalmem_dev) * DEVICE_NUM, GFP_KERNEL);
-    if (!globalmem_devp) {
+    globalmem_devs = kvcalloc(globalmem_nr_devs, sizeof(*globalmem_devs), GFP_KERNEL);
+    if (!globalmem_devs) {
         ret = -ENOMEM;
         goto fail_malloc;
     }
-
-    // init mutex
-    mutex_init(&globalmem_devp->mutex);
-    for (i = 0; i < DEVICE_NUM; ++i) {
-        globalmem_setup_cdev(globalmem_devp + i, i);
+    globalmem_cachep = KMEM_CACHE(globalmem_dev, SLAB_HWCACHE_ALIGN);
+    if (!globalmem_cachep) {
+        ret = -ENOMEM;
+        goto fail_cache;
     }
+
+    globalmem_debugfs = debugfs_create_dir("globalmem", NULL);
+    ret = globalmem_setup_cdev();
+    if (ret)
+        goto fail_cdev;
     
     return 0;
 
+fail_cdev:
+    debugfs_remove_recursive(globalmem_debugfs);
+    kmem_cache_destroy(globalmem_cachep);
+fail_cache:
+    kvfree(globalmem_devs);
 fail_malloc:
-    unregister_chrdev_region(devno, DEVICE_NUM);
+    unregister_chrdev_region(devno, globalmem_nr_devs);
     return ret;
 }
 
 static void __exit globalmem_exit(void) {
-    int i = 0; 
-    for (; i < DEVICE_NUM; ++i)
-        cdev_del(&(globalmem_devp + i)->cdev);  // unrigister cdev obj
-    kfree(globalmem_devp);
+    unsigned int i = 0; 
+    cdev_del(&globalmem_cdev);  // unrigister cdev obj
+    debugfs_remove_recursive(globalmem_debugfs);
+    for (; i < globalmem_nr_devs; ++i) {
+        if (globalmem_devs[i])
+            globalmem_free_dev(globalmem_devs[i]);
+    }
+    kvfree(globalmem_devs);
+    kmem_cache_destroy(globalmem_cachep);
     // release dev number
-    unregister_chrdev_region(MKDEV(globalmem_major, 0), DEVICE_NUM);
+    unregister_chrdev_region(MKDEV(globalmem_major, 0), globalmem_nr_devs);
 }
 
 module_init(globalmem_init);
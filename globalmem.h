@@ -1,25 +1,200 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/mm.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/xarray.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/cache.h>
+#include <linux/log2.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jhash.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
 
-#define GLOBALMEM_SIZE 0x1000
+#define GLOBALMEM_SIZE 0x1000            // default capacity of a device
+#define GLOBALMEM_MAX_SIZE (1ULL << 32)  // 4 GiB
+#define GLOBALMEM_CHUNK 256              // bounce buffer size of read/write
+#define GLOBALMEM_ATOMIC_MAX (64 << 10)  // reads and stores up to this are whole
+#define GLOBALMEM_NR_STRIPES 64          // locks striped over the offsets
+#define GLOBALMEM_MIN_STRIPE SMP_CACHE_BYTES
+#define GLOBALMEM_MAX_STRIPE (1U << 20)
 // #define MEM_CLEAR 0x1
 #define GLOBALMEM_MAJOR 230
-#define DEVICE_NUM      10
+#define GLOBALMEM_MAX_NODES 64           // entries of globalmem_node
+#define DEVICE_NUM      10               // default of globalmem_nr_devs
 
 #define GLOBALMEM_MAGIC 'g'
 #define MEM_CLEAR _IO(GLOBALMEM_MAGIC,0)
+#define MEM_RESIZE _IOW(GLOBALMEM_MAGIC, 1, __u64)  // new capacity in bytes
+#define MEM_SET_STRIPE _IOW(GLOBALMEM_MAGIC, 2, __u32)  // stripe size, power of 2
+#define MEM_CLEAR_RANGE _IOW(GLOBALMEM_MAGIC, 3, struct globalmem_range)
+#define MEM_BATCH _IOW(GLOBALMEM_MAGIC, 4, struct globalmem_batch)
+#define MEM_CAS _IOWR(GLOBALMEM_MAGIC, 5, struct globalmem_atomic)
+#define MEM_FETCH_ADD _IOWR(GLOBALMEM_MAGIC, 6, struct globalmem_atomic)
+#define MEM_XCHG _IOWR(GLOBALMEM_MAGIC, 7, struct globalmem_atomic)
+#define MEM_SET_KV _IOW(GLOBALMEM_MAGIC, 8, __u32)  // 1 to enter KV mode, 0 to leave
+#define MEM_KV_GET _IOWR(GLOBALMEM_MAGIC, 9, struct globalmem_kv)
+#define MEM_KV_PUT _IOW(GLOBALMEM_MAGIC, 10, struct globalmem_kv)
+#define MEM_KV_DEL _IOW(GLOBALMEM_MAGIC, 11, struct globalmem_kv)
+#define MEM_KV_MGET _IOWR(GLOBALMEM_MAGIC, 12, struct globalmem_kv_mget)
+#define MEM_SNAPSHOT _IO(GLOBALMEM_MAGIC, 13)  // returns a read-only fd
+
+struct globalmem_range {
+    __u64 offset;
+    __u64 len;
+};
+
+// MEM_BATCH: nr descriptors at ops, run as one against other stores and
+// readers. its reads see no store of up to GLOBALMEM_ATOMIC_MAX half done.
+// each gets result set to the bytes moved, short at the end of the device
+// like read()/write(), or to -errno. the ioctl itself fails only if the batch
+// as a whole can't be taken in
+#define GLOBALMEM_BATCH_READ  0
+#define GLOBALMEM_BATCH_WRITE 1
+#define GLOBALMEM_BATCH_MAX_OPS 256
+#define GLOBALMEM_BATCH_MAX_BYTES (64 << 10)  // summed over all descriptors
+
+struct globalmem_batch_op {
+    __u64 offset;
+    __u64 len;
+    __u64 buf;     // user pointer
+    __u32 op;      // GLOBALMEM_BATCH_READ/WRITE
+    __s32 result;
+};
+
+struct globalmem_batch {
+    __u64 ops;     // user pointer to nr struct globalmem_batch_op
+    __u32 nr;
+    __u32 pad;
+};
+
+// MEM_CAS stores val if the value is expect, MEM_FETCH_ADD adds val,
+// MEM_XCHG stores val. all three return the previous value in old
+struct globalmem_atomic {
+    __u64 offset;  // aligned to size
+    __u64 val;
+    __u64 expect;  // MEM_CAS only
+    __u64 old;
+    __u32 size;    // 4 or 8 bytes
+    __u32 pad;
+};
+
+// KV mode: the device is an open-addressing hash table of fixed slots,
+// linear probing from jhash(key) % (size / GLOBALMEM_KV_SLOT) over at most
+// GLOBALMEM_KV_MAX_PROBE slots, so that deleted slots piling up can't make
+// every miss walk the table. entering it empties the device, byte stores
+// and mappings are refused while in it
+#define GLOBALMEM_KV_SLOT 128
+#define GLOBALMEM_KV_MAX_PROBE 64
+#define GLOBALMEM_KV_KEY_MAX 32
+#define GLOBALMEM_KV_VAL_MAX 88
+#define GLOBALMEM_KV_MGET_MAX 64
+
+// slot states, a hole in the device reads as an empty slot
+#define GLOBALMEM_KV_EMPTY   0
+#define GLOBALMEM_KV_USED    1
+#define GLOBALMEM_KV_DELETED 2  // keeps the probe chains through it intact
+
+// a slot as it sits in the device, readable with read()
+struct globalmem_kv_slot {
+    __u32 seq;    // odd while the slot is being written
+    __u8 state;
+    __u8 klen;
+    __u8 vlen;
+    __u8 pad;
+    __u8 key[GLOBALMEM_KV_KEY_MAX];
+    __u8 val[GLOBALMEM_KV_VAL_MAX];
+};
+
+// MEM_KV_GET fills in val/vlen or fails with -ENOENT, MEM_KV_PUT fails
+// with -ENOSPC once no slot is left on the key's probe chain
+struct globalmem_kv {
+    __u8 klen;
+    __u8 vlen;
+    __u8 found;   // MEM_KV_MGET
+    __u8 pad[5];
+    __u8 key[GLOBALMEM_KV_KEY_MAX];
+    __u8 val[GLOBALMEM_KV_VAL_MAX];
+};
+
+// MEM_KV_MGET looks up nr keys in one go, returns how many were found
+struct globalmem_kv_mget {
+    __u64 kvs;    // user pointer to nr struct globalmem_kv
+    __u32 nr;
+    __u32 pad;
+};
 
 static int globalmem_major = GLOBALMEM_MAJOR;
 module_param(globalmem_major, int, S_IRUGO);
 
+static unsigned long globalmem_size = GLOBALMEM_SIZE;
+module_param(globalmem_size, ulong, S_IRUGO);
+
+// minors to register, a device only takes memory once opened
+static unsigned int globalmem_nr_devs = DEVICE_NUM;
+module_param(globalmem_nr_devs, uint, S_IRUGO);
+// NUMA node of each minor's memory, in minor order. minors past the end
+// take the last entry, -1 (the default) puts a device on the node of the
+// process that first opens it
+static int globalmem_node[GLOBALMEM_MAX_NODES];
+static int globalmem_nr_node;
+module_param_array(globalmem_node, int, &globalmem_nr_node, S_IRUGO);
+
+// offsets (pos >> stripe_shift) % GLOBALMEM_NR_STRIPES share a stripe
+struct globalmem_stripe {
+    struct mutex lock;     // serializes stores to the stripe
+    seqcount_mutex_t seq;  // bumped around them for the lockless readers
+} ____cacheline_aligned_in_smp;
+
+// per-CPU, summed up by <debugfs>/globalmem/globalmemN/stats. calls that
+// moved data count as ops, waits are stores blocked on a stripe or a resize
+struct globalmem_stats {
+    u64 reads;
+    u64 read_bytes;
+    u64 writes;
+    u64 write_bytes;
+    u64 waits;
+    u64 eagain;
+};
+
+// from globalmem_cachep, cacheline aligned so devices never share a line
 struct globalmem_dev {
-    struct cdev cdev;  // char device struct
-    unsigned char mem[GLOBALMEM_SIZE];
-    struct mutex mutex;
+    int minor;
+    int node;  // NUMA node its memory comes from
+    struct xarray pages;  // page index -> struct page, filled on first write
+    size_t size;          // capacity in bytes
+    unsigned int stripe_shift;
+    atomic_t mmap_count;  // live mappings pin the capacity
+    // taken shared around stores, exclusive to change size or stripes
+    struct percpu_rw_semaphore layout_sem;
+    struct globalmem_stripe stripes[GLOBALMEM_NR_STRIPES];
+    struct mutex batch_lock;  // stores of several stripes nest their locks in it
+    bool kv;                  // MEM_SET_KV, changed with layout_sem exclusive
+    struct list_head snaps;   // MEM_SNAPSHOT, changed with layout_sem exclusive
+    struct globalmem_stats __percpu *stats;
+};
+
+// MEM_SNAPSHOT: the device as it was. pages stored to since then have
+// their old contents in here, the others are still read from the device
+struct globalmem_snap {
+    struct globalmem_dev *dev;
+    struct list_head list;
+    struct xarray pages;  // page index -> struct page, copied on write
+    size_t size;
 };
 
-struct globalmem_dev* globalmem_devp;
+// one cdev covers every minor, globalmem_devs[minor] is set up on open
+static struct cdev globalmem_cdev;
+static struct globalmem_dev **globalmem_devs;
+static DEFINE_MUTEX(globalmem_devs_lock);
+static struct kmem_cache *globalmem_cachep;
+static struct dentry *globalmem_debugfs;
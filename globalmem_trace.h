@@ -0,0 +1,94 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM globalmem
+
+#if !defined(_GLOBALMEM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GLOBALMEM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// @ret is what the call at offset @pos returns
+DECLARE_EVENT_CLASS(globalmem_io,
+    TP_PROTO(int minor, unsigned long pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, pos)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("globalmem%d pos=%lu ret=%zd", __entry->minor, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(globalmem_io, globalmem_read,
+    TP_PROTO(int minor, unsigned long pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret)
+);
+
+DEFINE_EVENT(globalmem_io, globalmem_write,
+    TP_PROTO(int minor, unsigned long pos, ssize_t ret),
+    TP_ARGS(minor, pos, ret)
+);
+
+// MEM_CLEAR and MEM_CLEAR_RANGE
+TRACE_EVENT(globalmem_clear,
+    TP_PROTO(int minor, u64 offset, u64 len),
+    TP_ARGS(minor, offset, len),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u64, offset)
+        __field(u64, len)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->len = len;
+    ),
+
+    TP_printk("globalmem%d offset=%llu len=%llu", __entry->minor, __entry->offset, __entry->len)
+);
+
+// a store at @pos blocking on a busy stripe or a resize, and going on
+DECLARE_EVENT_CLASS(globalmem_wait,
+    TP_PROTO(int minor, unsigned long pos),
+    TP_ARGS(minor, pos),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, pos)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+    ),
+
+    TP_printk("globalmem%d pos=%lu", __entry->minor, __entry->pos)
+);
+
+DEFINE_EVENT(globalmem_wait, globalmem_sleep,
+    TP_PROTO(int minor, unsigned long pos),
+    TP_ARGS(minor, pos)
+);
+
+DEFINE_EVENT(globalmem_wait, globalmem_wakeup,
+    TP_PROTO(int minor, unsigned long pos),
+    TP_ARGS(minor, pos)
+);
+
+#endif /* _GLOBALMEM_TRACE_H */
+
+// out of tree, the Makefile puts the module directory on the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE globalmem_trace
+#include <trace/define_trace.h>
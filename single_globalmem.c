@@ -1,4 +1,4 @@
-#include "globalmem.h"
+#include "single_globalmem.h"
 
 static int globalmem_open(struct inode *inode, struct file *filp) {
     filp->private_data = globalmem_devp;